@@ -312,10 +312,14 @@ bool parse_int(std::string_view name, T& value, std::string_view s,
 	T tmp{};
 	auto r = std::from_chars(s.data(), s.data() + s.size(), tmp);
 	// String tail is not checked as a form of backward compat
-	if (r.ec != std::errc())
-		return false;
-	if (tmp < min || tmp > max)
+	if (r.ec == std::errc::invalid_argument)
 		return false;
+	if (r.ec != std::errc() || tmp < min || tmp > max) {
+		// Recognized, the value is left unchanged
+		warn("%.*s = %.*s is out of range (%lld-%lld)", (int)name.size(), name.data(),
+			int(r.ptr - s.data()), s.data(), (long long)min, (long long)max);
+		return true;
+	}
 	value = tmp;
 	return true;
 }
@@ -361,25 +365,84 @@ static std::pair<descriptor, std::string_view> lookup_keycode(std::string_view s
 	}
 }
 
-static struct descriptor *layer_lookup_chord(struct layer *layer, decltype(chord::keys)& keys, size_t n)
+void layer::index_chord(size_t i)
 {
-	for (size_t i = 0; i < layer->chords.size(); i++) {
-		size_t nm = 0;
-		struct chord *chord = &layer->chords[i];
-
-		for (size_t j = 0; j < n; j++) {
-			for (size_t k = 0; k < chord->keys.size(); k++)
-				if (keys[j] == chord->keys[k]) {
-					nm++;
-					break;
-				}
+	if (chord_trie.empty())
+		chord_trie.emplace_back();
+
+	uint32_t node = 0;
+	chord_trie[0].count++;
+
+	for (uint16_t key : chords[i].keys) {
+		uint32_t prev = 0;
+		uint32_t cur = chord_trie[node].child;
+
+		while (cur && chord_trie[cur].key < key) {
+			prev = cur;
+			cur = chord_trie[cur].sibling;
 		}
 
-		if (nm == n)
-			return &chord->d;
+		if (!cur || chord_trie[cur].key != key) {
+			chord_node& n = chord_trie.emplace_back();
+			n.key = key;
+			n.sibling = cur;
+
+			cur = chord_trie.size() - 1;
+			(prev ? chord_trie[prev].sibling : chord_trie[node].child) = cur;
+		}
+
+		node = cur;
+		chord_trie[node].count++;
+	}
+
+	chord_trie[node].chord = i;
+}
+
+void layer::index_chords()
+{
+	chord_trie.clear();
+	for (size_t i = 0; i < chords.size(); i++)
+		index_chord(i);
+}
+
+/* Return the index of the chord consisting of exactly keys, or -1. */
+int layer::find_chord(const uint16_t *keys, size_t n) const
+{
+	if (chord_trie.empty())
+		return -1;
+
+	uint32_t node = 0;
+	for (size_t i = 0; i < n; i++) {
+		uint32_t cur = chord_trie[node].child;
+
+		while (cur && chord_trie[cur].key < keys[i])
+			cur = chord_trie[cur].sibling;
+		if (!cur || chord_trie[cur].key != keys[i])
+			return -1;
+
+		node = cur;
 	}
 
-	return NULL;
+	return chord_trie[node].chord;
+}
+
+/* Return true if a chord below node contains keys and at least one more key. */
+bool layer::chord_partial(const uint16_t *keys, size_t n, uint32_t node, bool skipped) const
+{
+	if (chord_trie.empty())
+		return false;
+
+	const chord_node& cur = chord_trie[node];
+	if (!n)
+		return cur.count > uint32_t(!skipped && cur.chord >= 0);
+
+	// Keys smaller than the next wanted one may be skipped
+	for (uint32_t c = cur.child; c && chord_trie[c].key <= keys[0]; c = chord_trie[c].sibling) {
+		if (chord_trie[c].key == keys[0] ? chord_partial(keys + 1, n - 1, c, skipped) : chord_partial(keys, n, c, true))
+			return true;
+	}
+
+	return false;
 }
 
 static uint8_t get_mods(long idx)
@@ -406,15 +469,14 @@ static int parse_descriptor(std::string_view s, struct descriptor *d, struct con
 
 static bool set_layer_entry(struct config *config, int16_t idx, std::string_view s)
 {
-	struct chord chord{};
-	size_t n = 0;
+	std::vector<uint16_t> keys;
 
 	struct descriptor dd{};
 	struct descriptor* d = &dd;
 
 	while (true) {
 		auto [desc, next] = lookup_keycode(s);
-		if (n || next.starts_with('+')) {
+		if (!keys.empty() || next.starts_with('+')) {
 			if (!desc || desc.mods || desc.wildcard) {
 				err("%.*s is not a valid chord key", (int)s.size(), s.data());
 				return -1;
@@ -432,12 +494,7 @@ static bool set_layer_entry(struct config *config, int16_t idx, std::string_view
 				return -1;
 			}
 
-			if (n >= ARRAY_SIZE(chord.keys)) {
-				err("chords cannot contain more than %zu keys", n);
-				return -1;
-			}
-
-			chord.keys[n++] = desc.id;
+			keys.push_back(desc.id);
 
 			if (next.starts_with('+')) {
 				s = next;
@@ -446,14 +503,19 @@ static bool set_layer_entry(struct config *config, int16_t idx, std::string_view
 			}
 		}
 
-		if (n) {
+		if (!keys.empty()) {
 			if (parse_descriptor(get_ini_value(next), d, config) < 0)
 				return false;
 
-			if (!(d = layer_lookup_chord(&config->layers[idx], chord.keys, n))) {
-				config->layers[idx].chords.emplace_back(chord).d = dd;
+			std::sort(keys.begin(), keys.end());
+
+			// parse_descriptor can create layers
+			struct layer *layer = &config->layers[idx];
+			if (int i = layer->find_chord(keys.data(), keys.size()); i >= 0) {
+				layer->chords[i].d = dd;
 			} else {
-				*d = dd;
+				layer->chords.push_back({make_smart_array(keys), dd});
+				layer->index_chord(layer->chords.size() - 1);
 			}
 			return true;
 		}
@@ -616,6 +678,8 @@ static int config_access_layer(struct config *config, std::string_view name, boo
 	config->layer_index.insert(it, idx);
 	auto& _new = config->layers.emplace_back();
 	aux_alloc(), _new.composition = make_smart_array(compose);
+	if (config->finalized)
+		config->index_composites();
 	return idx;
 }
 
@@ -920,6 +984,8 @@ static void parse_global_section(struct config* config, const char* file, size_t
 		return;
 	else if (parse_int("chord_timeout", config->chord_interkey_timeout, s, 0))
 		return;
+	else if (parse_int("chord_max_active", config->chord_max_active, s, 1, KEYD_CHORD_MAX - KEYD_CHORD_1 + 1))
+		return;
 	else if (s.starts_with("default_layout") && s.find_first_of(C_SPACES "=") == 14)
 		return config->default_layout = make_string(s.substr(s.find_last_of(C_SPACES "=") + 1)), void(); // TODO
 	else if (parse_int("macro_repeat_timeout", config->macro_repeat_timeout, s, 0))
@@ -928,6 +994,8 @@ static void parse_global_section(struct config* config, const char* file, size_t
 		return;
 	else if (parse_int("overload_tap_timeout", config->overload_tap_timeout, s, 0))
 		return;
+	else if (parse_int("separate_output", config->separate_output, s, 0, 1))
+		return;
 	else
 		warn("[%s] line %zd: %.*s is not a valid global option", file, ln, (int)s.size(), s.data());
 }
@@ -1181,6 +1249,47 @@ int config_check_match(struct config *config, const char *id, uint8_t flags)
 	return 0;
 }
 
+/*
+ * Like config_check_match(), but only the <vendor>:<product> part of the id
+ * is known. Returns true if some device with that prefix may be matched.
+ */
+bool config_may_match(const struct config *config, const char *id, uint8_t flags)
+{
+	for (auto& ent : config->ids) {
+		if (ent.flags & ID_EXCLUDED)
+			continue;
+		if ((ent.flags & flags) && !strncmp(id, ent.id.data(), std::min(strlen(id), strlen(ent.id.data()))))
+			return true;
+	}
+
+	if ((config->wildcard & CAP_KEYBOARD) && (flags & ID_KEYBOARD))
+		return true;
+	if ((config->wildcard & CAP_MOUSE) && (flags & ID_MOUSE))
+		return true;
+	if ((config->wildcard & CAP_MOUSE_ABS) && (flags & ID_ABS_PTR))
+		return true;
+
+	return false;
+}
+
+/* Return true if code appears in any layer or chord of config. */
+bool config_binds_code(const struct config *config, uint16_t code)
+{
+	for (auto& layer : config->layers) {
+		for (auto& d : layer.keymap.mapv) {
+			if (d.id == code)
+				return true;
+		}
+
+		for (auto& chord : layer.chords) {
+			if (std::find(chord.keys.begin(), chord.keys.end(), code) != chord.keys.end())
+				return true;
+		}
+	}
+
+	return false;
+}
+
 int config_add_entry(struct config* config, std::string_view section, std::string_view exp)
 {
 	int idx = section.empty() ? 0 : config_access_layer(config, section);
@@ -1233,6 +1342,7 @@ void config_backup::restore(struct keyboard* kbd)
 	for (size_t i = 0; i < layers.size(); i++) {
 		auto& layer = cfg.layers[i];
 		layer.chords.assign(layers[i].chords.begin(), layers[i].chords.end());
+		layer.index_chords();
 		layer.keymap.mapv.assign(layers[i].keymap.begin(), layers[i].keymap.end());
 	}
 	std::erase_if(cfg.layer_index, [&](uint16_t idx) {
@@ -1243,6 +1353,7 @@ void config_backup::restore(struct keyboard* kbd)
 	cfg.macros.resize(macro_count);
 	cfg.commands.resize(cmd_count);
 	cfg.cmd_env = this->_env;
+	cfg.index_composites();
 }
 
 void config::finalize() noexcept
@@ -1251,9 +1362,29 @@ void config::finalize() noexcept
 		layer.keymap.sort();
 		// TODO: report unreachable layers
 	}
+	index_composites();
 	finalized = true;
 }
 
+void config::index_composites()
+{
+	composites.clear();
+	composite_masks.clear();
+	mask_words = (layers.size() + 63) / 64;
+
+	for (size_t i = MAX_MOD + 1; i < layers.size(); i++) {
+		if (!layers[i].composition)
+			continue;
+
+		composites.push_back(i);
+		composite_masks.resize(composite_masks.size() + mask_words);
+
+		uint64_t *mask = &composite_masks[composite_masks.size() - mask_words];
+		for (uint16_t j : layers[i])
+			mask[j / 64] |= uint64_t(1) << (j % 64);
+	}
+}
+
 config::config()
 {
 	// Populate special layers
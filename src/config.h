@@ -104,11 +104,23 @@ struct descriptor_map {
 static_assert(sizeof(descriptor_map) == sizeof(std::vector<char>));
 
 struct chord {
-	std::array<uint16_t, 8> keys;
+	smart_ptr<uint16_t[]> keys; // Sorted
 	struct descriptor d;
 };
 
-static_assert(sizeof(chord) == 26);
+static_assert(sizeof(chord) == 24);
+
+/*
+ * Node of a trie over the sorted keys of the chords of a layer. Node 0 is the
+ * root, links to 0 mean none, and siblings are sorted by key.
+ */
+struct chord_node {
+	uint16_t key = 0;
+	int32_t chord = -1; // Chord ending here
+	uint32_t count = 0; // Chords ending in this subtree
+	uint32_t child = 0;
+	uint32_t sibling = 0;
+};
 
 /*
  * A layer is a map from keys to descriptors.
@@ -120,6 +132,14 @@ struct layer {
 	std::vector<chord> chords;
 	smart_ptr<uint16_t[]> composition;
 
+	std::vector<chord_node> chord_trie;
+
+	void index_chord(size_t i);
+	void index_chords();
+	// Both take sorted keys
+	int find_chord(const uint16_t *keys, size_t n) const;
+	bool chord_partial(const uint16_t *keys, size_t n, uint32_t node = 0, bool skipped = false) const;
+
 	size_t size() const
 	{
 		return composition.size();
@@ -177,6 +197,14 @@ struct alias_list {
 struct config {
 	std::vector<layer> layers;
 	std::vector<uint16_t> layer_index;
+
+	/*
+	 * Composite layers in index order, and their members as bitsets of
+	 * mask_words words each (stored back to back in composite_masks).
+	 */
+	std::vector<uint16_t> composites;
+	std::vector<uint64_t> composite_masks;
+	size_t mask_words = 0;
 	std::array<smart_ptr<uint16_t[]>, 8> modifiers;
 
 	bool is_mod(size_t i, uint16_t id) {
@@ -206,12 +234,14 @@ struct config {
 
 	int64_t chord_interkey_timeout = 50;
 	int64_t chord_hold_timeout = 0;
+	uint8_t chord_max_active = 3;
 
 	bool compat : 1 = false;
 	bool finalized : 1 = false;
 	uint8_t wildcard = 0;
 	uint8_t layer_indicator = 255;
 	uint8_t disable_modifier_guard = 0;
+	uint8_t separate_output = 0;
 
 	// Section-specific modifiers
 	uint8_t add_left_mods = 0;
@@ -222,6 +252,7 @@ struct config {
 	const_string pathstr;
 
 	void finalize() noexcept;
+	void index_composites();
 
 	config();
 	config(const config&) = delete;
@@ -253,5 +284,7 @@ bool config_parse(struct config *config, const char *path);
 int config_add_entry(struct config *config, std::string_view, std::string_view);
 
 int config_check_match(struct config *config, const char *id, uint8_t flags);
+bool config_may_match(const struct config *config, const char *id, uint8_t flags);
+bool config_binds_code(const struct config *config, uint16_t code);
 
 #endif
@@ -1,6 +1,9 @@
 #include "keyd.h"
 #include "log.h"
+#include <algorithm>
 #include <bitset>
+#include <functional>
+#include <string>
 #include <utility>
 #include "concat.hpp"
 
@@ -9,11 +12,24 @@
 #endif
 
 static int ipcfd = -1;
-static struct vkbd* vkbd;
 static std::vector<std::unique_ptr<keyboard>> configs;
-extern std::array<device, 128> device_table;
+extern std::vector<std::unique_ptr<device>> device_table;
+
+/*
+ * A virtual output device and the keys held on it. Configs with
+ * separate_output get their own (kept across reloads while a config still
+ * uses it), all others share the first one.
+ */
+struct output_dev {
+	std::string name;
+	struct vkbd *vkbd;
+	std::bitset<KEY_CNT> keystate;
+};
+
+static std::vector<std::unique_ptr<output_dev>> outputs;
 
-static std::bitset<KEY_CNT> keystate{};
+// Receives send_key() and mouse output
+static struct output_dev *out;
 
 void* aux_ss_head = nullptr;
 size_t aux_ss_count = 0;
@@ -68,39 +84,139 @@ static std::array<listener, 32> listeners;
 
 static struct keyboard *active_kbd = NULL;
 
+struct timer {
+	int64_t deadline;
+	struct keyboard *kbd;
+
+	bool operator>(const timer& r) const noexcept
+	{
+		return deadline > r.deadline;
+	}
+};
+
+/*
+ * Deadlines of all keyboards (min-heap). Entries are invalidated lazily: an
+ * entry is stale if it no longer matches the deadline of its keyboard.
+ */
+static std::vector<timer> timers;
+
+static void schedule_deadline(struct keyboard *kbd, int64_t deadline)
+{
+	if (kbd->deadline == deadline)
+		return;
+
+	kbd->deadline = deadline;
+	if (deadline) {
+		timers.push_back({deadline, kbd});
+		std::push_heap(timers.begin(), timers.end(), std::greater<>());
+	}
+}
+
+/* Return the earliest valid deadline, discarding stale entries. */
+static int64_t next_deadline()
+{
+	while (!timers.empty() && timers.front().kbd->deadline != timers.front().deadline) {
+		std::pop_heap(timers.begin(), timers.end(), std::greater<>());
+		timers.pop_back();
+	}
+
+	return timers.empty() ? 0 : timers.front().deadline;
+}
+
+// Macro received over IPC, played back independently of the keyboards
+static struct {
+	::macro macro;
+	struct macro_cursor cursor;
+	int64_t resume;
+} ipc_macro;
+
+static void play_ipc_macro(int64_t time)
+{
+	if (int64_t delay = macro_step(ipc_macro.cursor))
+		ipc_macro.resume = time + delay;
+}
+
 static void cleanup()
 {
 	for (auto& dev : device_table) {
-		if (dev.fd > 0) {
-			if (auto kbd = (struct keyboard*)dev.data) {
-				if (auto led = kbd->config.layer_indicator; led < LED_CNT) {
-					dev.led_state[led] = 0;
-				}
+		if (auto kbd = (struct keyboard*)dev->data) {
+			if (auto led = kbd->config.layer_indicator; led < LED_CNT) {
+				dev->led_state[led] = 0;
 			}
-			device_ungrab(&dev);
-			close(dev.fd);
-			dev.fd = -1;
 		}
+		device_ungrab(dev.get());
+		close(dev->fd);
+		dev->fd = -1;
+	}
+}
+
+static struct output_dev *get_output(const char *name)
+{
+	for (auto& out : outputs) {
+		if (out->name == name)
+			return out.get();
 	}
+
+	auto& out = outputs.emplace_back(std::make_unique<output_dev>());
+	out->name = name;
+	out->vkbd = vkbd_init(name);
+
+	return out.get();
+}
+
+/* Output device of kbd (NULL for the shared one). */
+static struct output_dev *kbd_output(const struct keyboard *kbd)
+{
+	return kbd && kbd->output.data ? (struct output_dev*)kbd->output.data : outputs[0].get();
+}
+
+static void select_output(const struct keyboard *kbd)
+{
+	out = kbd_output(kbd);
+}
+
+static void flush_outputs()
+{
+	for (auto& out : outputs)
+		vkbd_flush(out->vkbd);
 }
 
 static void clear_vkbd()
 {
-	for (size_t i = 0; i < keystate.size(); i++) {
-		if (keystate[i]) {
-			vkbd_send_key(vkbd, i, 0);
-			keystate[i] = 0;
+	for (auto& out : outputs) {
+		for (size_t i = 0; i < out->keystate.size(); i++) {
+			if (out->keystate[i]) {
+				vkbd_send_key(out->vkbd, i, 0);
+				out->keystate[i] = 0;
+			}
 		}
 	}
 
-	vkbd_flush(vkbd);
+	flush_outputs();
+}
+
+/* Destroy the separate outputs no config uses anymore (keys must be released). */
+static void prune_outputs()
+{
+	std::erase_if(outputs, [](auto& o) {
+		if (o == outputs[0])
+			return false;
+		for (auto& kbd : configs)
+			if (kbd->output.data == o.get())
+				return false;
+
+		vkbd_free(o->vkbd);
+		return true;
+	});
+
+	out = outputs[0].get();
 }
 
 static void send_key(uint16_t code, uint8_t state)
 {
-	if (code < keystate.size())
-		keystate[code] = state;
-	vkbd_send_key(vkbd, code, state);
+	if (code < out->keystate.size())
+		out->keystate[code] = state;
+	vkbd_send_key(out->vkbd, code, state);
 }
 
 static void add_listener(::listener con)
@@ -148,21 +264,15 @@ static void activate_leds(const struct keyboard *kbd)
 	if (ind > LED_MAX)
 		return;
 
-	int active_layers = 0;
-
-	for (size_t i = 1; i < kbd->config.layers.size(); i++)
-		if (i != size_t(kbd->layout) && kbd->layer_state[i].active()) {
-			active_layers = 1;
-			break;
-		}
+	int active_layers = std::any_of(kbd->active_layers.begin(), kbd->active_layers.end(), [&](uint16_t i) {
+		return i != 0 && i != kbd->layout;
+	});
 
-	for (size_t i = 0; i < device_table.size(); i++) {
-		if (device_table[i].fd <= 0)
-			break;
-		if (device_table[i].data == kbd && (device_table[i].capabilities & CAP_LEDS)) {
-			if (std::exchange(device_table[i].led_state[ind], active_layers) == active_layers)
+	for (auto& dev : device_table) {
+		if (dev->data == kbd && dev->grabbed && (dev->capabilities & CAP_LEDS)) {
+			if (std::exchange(dev->led_state[ind], active_layers) == active_layers)
 				continue;
-			device_set_led(&device_table[i], ind, active_layers);
+			device_set_led(dev.get(), ind, active_layers);
 		}
 	}
 }
@@ -218,6 +328,11 @@ static void load_configs()
 					.send_key = send_key,
 					.on_layer_change = on_layer_change,
 				};
+				if (kbd->config.separate_output) {
+					auto stem = std::string_view(dirent->d_name);
+					stem.remove_suffix(5);
+					kbd->output.data = get_output(concat(VKBD_NAME, stem, " ").c_str());
+				}
 				configs.emplace_back(new_keyboard(std::move(kbd)));
 			} else {
 				keyd_log("DEVICE: y{WARNING} failed to parse %s\n", name.c_str());
@@ -246,36 +361,124 @@ static std::unique_ptr<keyboard>* lookup_config_ent(const char *id, uint8_t flag
 	return match;
 }
 
-static void manage_device(struct device *dev)
+/*
+ * Advance the grab of a matched device. While keys are held the device stays
+ * pending and this is repeated on its next activity.
+ */
+static void grab_device(struct device *dev)
 {
-	uint8_t flags = 0;
+	struct keyboard *kbd = (struct keyboard*)dev->data;
 
-	if (dev->is_virtual)
-		return;
+	switch (device_grab(dev)) {
+	case 0:
+		keyd_log("DEVICE: g{match}    %s  %s\t(%s)\n",
+			  dev->id, kbd->config.pathstr.c_str(), dev->name);
+
+		if (dev->capabilities & CAP_LEDS)
+			device_set_led(dev, kbd->config.layer_indicator, 0);
+		break;
+	case 1:
+		break;
+	default:
+		keyd_log("DEVICE: y{WARNING} Failed to grab /dev/input/%u\n", dev->num);
+		dev->data = NULL;
+		break;
+	}
+
+	device_update_mask(dev);
+}
 
-	if (dev->capabilities & CAP_KEYBOARD)
+static uint8_t id_flags(uint8_t capabilities)
+{
+	uint8_t flags = 0;
+
+	if (capabilities & CAP_KEYBOARD)
 		flags |= ID_KEYBOARD;
-	if (dev->capabilities & (CAP_MOUSE|CAP_MOUSE_ABS))
+	if (capabilities & (CAP_MOUSE|CAP_MOUSE_ABS))
 		flags |= ID_MOUSE;
-	if (dev->capabilities & CAP_MOUSE_ABS)
+	if (capabilities & CAP_MOUSE_ABS)
 		flags |= ID_ABS_PTR;
 
-	if (auto ent = lookup_config_ent(dev->id, flags)) {
-		if (device_grab(dev)) {
-			keyd_log("DEVICE: y{WARNING} Failed to grab /dev/input/%u\n", dev->num);
-			dev->data = NULL;
-			return;
+	return flags;
+}
+
+/* Skip opening nodes which no loaded config can match. */
+static bool filter_device(const struct device_info *info)
+{
+	char id[10];
+
+	// LED events are received from the virtual keyboard
+	if (info->is_virtual)
+		return true;
+
+	snprintf(id, sizeof id, "%04x:%04x", info->vendor, info->product);
+	for (auto& kbd : configs) {
+		if (config_may_match(&kbd->config, id, id_flags(info->capabilities)))
+			return true;
+	}
+
+	return false;
+}
+
+/* Drop what outputs other than keep hold for dev. */
+static void remove_source(struct device *dev, const struct output_dev *keep = nullptr)
+{
+	for (auto& out : outputs)
+		if (out.get() != keep)
+			vkbd_remove_source(out->vkbd, dev->fd);
+}
+
+/*
+ * Pointer events of matched mice and touchpads bypass the engine, except for
+ * the buttons and wheel bound by their config (and see route_button()).
+ */
+static void update_passthrough(struct device *dev)
+{
+	const struct keyboard *kbd = (struct keyboard*)dev->data;
+	const bool passthrough = kbd && (dev->capabilities & (CAP_MOUSE|CAP_MOUSE_ABS));
+
+	// Destroying the clone releases its buttons, also when the config moved to another output
+	if (dev->passthrough)
+		remove_source(dev, passthrough ? kbd_output(kbd) : nullptr);
+
+	dev->passthrough = passthrough;
+	if (!passthrough)
+		return;
+
+	memset(dev->remap_buttons, 0, sizeof dev->remap_buttons);
+	for (uint16_t code = BTN_MISC; code < KEY_OK; code++) {
+		if (config_binds_code(&kbd->config, code)) {
+			const int i = code - BTN_MISC;
+			dev->remap_buttons[i / 8] |= 1 << (i % 8);
 		}
+	}
 
-		keyd_log("DEVICE: g{match}    %s  %s\t(%s)\n",
-			  dev->id, ent->get()->config.pathstr.c_str(), dev->name);
+	dev->remap_wheel = 0;
+	for (uint16_t code = KEYD_WHEELUP; code <= KEYD_WHEELRIGHT; code++)
+		dev->remap_wheel |= config_binds_code(&kbd->config, code);
+}
+
+static void manage_device(struct device *dev)
+{
+	uint8_t flags = id_flags(dev->capabilities);
+
+	if (dev->is_virtual) {
+		device_update_mask(dev);
+		return;
+	}
+
+	// Held keys belonged to the previous config
+	memset(dev->keys, 0, sizeof dev->keys);
 
+	if (auto ent = lookup_config_ent(dev->id, flags)) {
 		dev->data = ent->get();
-		if (dev->capabilities & CAP_LEDS)
-			device_set_led(dev, ent->get()->config.layer_indicator, 0);
+		update_passthrough(dev);
+		grab_device(dev);
 	} else {
 		dev->data = NULL;
+		update_passthrough(dev);
 		device_ungrab(dev);
+		device_update_mask(dev);
 		keyd_log("DEVICE: r{ignoring} %s  (%s)\n", dev->id, dev->name);
 	}
 }
@@ -283,16 +486,16 @@ static void manage_device(struct device *dev)
 [[gnu::noinline]] static void reload(const smart_ptr<env_pack>& env) noexcept
 {
 	for (auto& dev : device_table) {
-		if (dev.fd > 0) {
-			if (auto kbd = (struct keyboard*)dev.data) {
-				if (auto led = kbd->config.layer_indicator; led < LED_CNT) {
-					dev.led_state[led] = 0;
-					device_set_led(&dev, led, 0);
-				}
+		if (auto kbd = (struct keyboard*)dev->data) {
+			if (auto led = kbd->config.layer_indicator; led < LED_CNT) {
+				dev->led_state[led] = 0;
+				device_set_led(dev.get(), led, 0);
 			}
 		}
 	}
 
+	timers.clear();
+	active_kbd = NULL;
 	configs.clear();
 	if (aux_alloc aux; aux.get_head() && aux.get_count()) {
 		fprintf(stderr, "Aux heap not cleared, exiting.\n");
@@ -305,12 +508,14 @@ static void manage_device(struct device *dev)
 	load_configs();
 
 	for (auto& dev : device_table) {
-		if (dev.fd <= 0)
-			break;
-		manage_device(&dev);
+		manage_device(dev.get());
 	}
 
+	// Nodes skipped so far may match the new configs
+	device_rescan();
+
 	clear_vkbd();
+	prune_outputs();
 
 	if (env && env->uid >= 1000) {
 		// Load user bindings (may be not loaded when executed as root)
@@ -329,6 +534,7 @@ static void manage_device(struct device *dev)
 
 		for (auto& kbd : configs) {
 			kbd->config.cmd_env = env;
+			select_output(kbd.get());
 			for (auto str : split_char<'\n'>(file.view())) {
 				if (str.empty() || str == "reset")
 					continue;
@@ -377,6 +583,7 @@ static int input(char *buf, [[maybe_unused]] size_t sz, uint32_t timeout)
 	uint8_t codes[4];
 
 	int csz;
+	struct vkbd *vkbd = outputs[0]->vkbd;
 
 	while ((csz = utf8_read_char(buf, &codepoint))) {
 		int found = 0;
@@ -465,13 +672,17 @@ static bool handle_message(::listener& con, const smart_ptr<env_pack>& cmd_env)
 		while (msg.sz && msg.data[msg.sz-1] == '\n')
 			msg.data[--msg.sz] = 0;
 
-		::macro macro;
-		if (macro_parse(msg.data, macro, nullptr, cmd_env)) {
+		// A new macro completes the previous one without delays
+		select_output(nullptr);
+		macro_finish(ipc_macro.cursor);
+
+		if (macro_parse(msg.data, ipc_macro.macro, nullptr, cmd_env)) {
 			send_fail(con, "%s", errstr);
 			break;
 		}
 
-		macro_execute(send_key, macro, msg.timeout, nullptr);
+		macro_start(ipc_macro.cursor, send_key, ipc_macro.macro, msg.timeout, nullptr);
+		play_ipc_macro(get_time_us());
 		send_success(con);
 		break;
 	}
@@ -522,6 +733,7 @@ static bool handle_message(::listener& con, const smart_ptr<env_pack>& cmd_env)
 			} else {
 				kbd->config.cmd_env = cmd_env;
 			}
+			select_output(kbd.get());
 			success |= kbd_eval(kbd.get(), expr);
 		}
 
@@ -541,6 +753,12 @@ static bool handle_message(::listener& con, const smart_ptr<env_pack>& cmd_env)
 			kbd->update_layer_state();
 		}
 
+		// Buttons may have been bound or unbound
+		for (auto& dev : device_table) {
+			update_passthrough(dev.get());
+			device_update_mask(dev.get());
+		}
+
 		if (success)
 			send_success(con);
 		else
@@ -613,123 +831,266 @@ try {
 }
 }
 
-static int event_handler(struct event *ev)
+/*
+ * Turn pointer motion into smooth scrolling while a scroll action is active,
+ * sensitivity mouse units making up one detent. Remainders are kept in
+ * 1/sensitivity of a wheel unit.
+ */
+static void scroll_motion(struct keyboard *kbd, int x, int y)
 {
-	static int64_t last_time = 0;
-	static int timeout = 0;
+	if (kbd->scroll.sensitivity == 0)
+		return;
+	int xunits, yunits;
+
+	kbd->scroll.y += y * WHEEL_DETENT;
+	kbd->scroll.x += x * WHEEL_DETENT;
+
+	yunits = kbd->scroll.y / kbd->scroll.sensitivity;
+	kbd->scroll.y %= kbd->scroll.sensitivity;
+
+	xunits = kbd->scroll.x / kbd->scroll.sensitivity;
+	kbd->scroll.x %= kbd->scroll.sensitivity;
+
+	if (xunits || yunits)
+		vkbd_mouse_scroll(out->vkbd, xunits, -yunits);
+}
+
+/* Process key events and queue the resulting timeout as an absolute deadline. */
+static void process_events(struct keyboard *kbd, const struct key_event *events, size_t n, bool real = false)
+{
+	select_output(kbd);
+
+	int64_t timeout = kbd_process_events(kbd, events, n, real);
+	schedule_deadline(kbd, timeout ? events[n - 1].timestamp + timeout : 0);
+}
+
+/*
+ * Pass a raw button event of a passthrough device to the engine while the
+ * keyboard has state a press resolves (e.g. a held overload or a oneshot),
+ * like a bound button. Its release follows, keys[] tells which ones it got.
+ */
+static bool route_button(struct keyboard *kbd, struct device *dev, const struct input_event& ev, int64_t time)
+{
+	const uint8_t bit = 1 << (ev.code % 8);
 	struct key_event kev = {};
 
-	timeout -= ev->timestamp - last_time;
-	last_time = ev->timestamp;
+	if (ev.value == 1 && !kbd_is_idle(kbd))
+		dev->keys[ev.code / 8] |= bit;
+	else if (!(dev->keys[ev.code / 8] & bit))
+		return false;
+	else if (ev.value == 0)
+		dev->keys[ev.code / 8] &= ~bit;
+	else
+		return true;
+
+	kev.code = ev.code;
+	kev.pressed = ev.value;
+	kev.timestamp = time;
+	process_events(kbd, &kev, 1, true);
+	return true;
+}
 
-	timeout = timeout < 0 ? 0 : timeout;
+static int64_t event_handler(struct event *ev)
+{
+	struct key_event kev = {};
 
 	switch (ev->type) {
 	case EV_TIMEOUT:
-		if (!active_kbd)
-			return 0;
+		// Deliver every expired deadline to its own keyboard
+		while (next_deadline() && timers.front().deadline <= ev->timestamp) {
+			struct keyboard *kbd = timers.front().kbd;
+
+			std::pop_heap(timers.begin(), timers.end(), std::greater<>());
+			timers.pop_back();
 
-		kev.code = 0;
-		kev.timestamp = ev->timestamp;
+			kev.code = 0;
+			kev.timestamp = std::exchange(kbd->deadline, 0);
+
+			process_events(kbd, &kev, 1);
+		}
 
-		timeout = kbd_process_events(active_kbd, &kev, 1);
+		if (ipc_macro.cursor.active() && ipc_macro.resume <= ev->timestamp) {
+			select_output(nullptr);
+			play_ipc_macro(ev->timestamp);
+		}
 		break;
 	case EV_DEV_EVENT:
-		if (ev->dev->data) {
+		if (ev->dev->grab_pending) {
+			// Input keeps reaching its current reader until the grab
+			grab_device(ev->dev);
+		} else if (ev->dev->data) {
 			struct keyboard *kbd = (struct keyboard*)ev->dev->data;
-			active_kbd = kbd;
-			switch (ev->devev->type) {
-			size_t i;
-			case DEV_KEY:
-				dbg("input %s %s", KEY_NAME(ev->devev->code), ev->devev->pressed ? "down" : "up");
+			struct key_event kevs[MAX_DEVICE_EVENTS];
+			size_t nr_kevs = 0;
 
-				kev.code = ev->devev->code;
-				kev.pressed = ev->devev->pressed;
-				kev.timestamp = ev->timestamp;
+			active_kbd = kbd;
+			select_output(kbd);
+			for (size_t j = 0; j < ev->nr_devev; j++) {
+				struct device_event *devev = &ev->devev[j];
+
+				if (devev->type == DEV_KEY) {
+					dbg("input %s %s", KEY_NAME(devev->code), devev->pressed ? "down" : "up");
+
+					if (devev->code < KEY_CNT) {
+						const uint8_t bit = 1 << (devev->code % 8);
+						if (devev->pressed)
+							ev->dev->keys[devev->code / 8] |= bit;
+						else
+							ev->dev->keys[devev->code / 8] &= ~bit;
+					}
 
-				timeout = kbd_process_events(kbd, &kev, 1, true);
-				break;
-			case DEV_MOUSE_MOVE:
-				if (kbd->scroll.active) {
-					if (kbd->scroll.sensitivity == 0)
-						break;
-					int xticks, yticks;
+					// Collect consecutive key events for a single pass
+					kevs[nr_kevs].code = devev->code;
+					kevs[nr_kevs].pressed = devev->pressed;
+					kevs[nr_kevs].timestamp = devev->timestamp;
+					nr_kevs++;
+					continue;
+				}
 
-					kbd->scroll.y += ev->devev->y;
-					kbd->scroll.x += ev->devev->x;
+				if (nr_kevs)
+					process_events(kbd, kevs, std::exchange(nr_kevs, 0), true);
 
-					yticks = kbd->scroll.y / kbd->scroll.sensitivity;
-					kbd->scroll.y %= kbd->scroll.sensitivity;
+				switch (devev->type) {
+				case DEV_MOUSE_MOVE:
+					if (kbd->scroll.active)
+						scroll_motion(kbd, devev->x, devev->y);
+					else
+						vkbd_mouse_move(out->vkbd, devev->x, devev->y);
+					break;
+				case DEV_RAW_FRAME: {
+					struct input_event *evs = ev->dev->raw + devev->code;
+					size_t n = devev->x;
+					size_t kept = 0;
+					int x = 0, y = 0;
+
+					// Motion turns into scrolling while active, the rest passes through
+					for (size_t k = 0; k < n; k++) {
+						const struct input_event& rev = evs[k];
+
+						if (kbd->scroll.active && rev.type == EV_REL && rev.code == REL_X)
+							x += rev.value;
+						else if (kbd->scroll.active && rev.type == EV_REL && rev.code == REL_Y)
+							y += rev.value;
+						else if (rev.type != EV_KEY || !route_button(kbd, ev->dev, rev, devev->timestamp))
+							evs[kept++] = rev;
+					}
 
-					xticks = kbd->scroll.x / kbd->scroll.sensitivity;
-					kbd->scroll.x %= kbd->scroll.sensitivity;
+					if (x || y)
+						scroll_motion(kbd, x, y);
 
-					vkbd_mouse_scroll(vkbd, 0, -1*yticks);
-					vkbd_mouse_scroll(vkbd, 0, xticks);
-				} else {
-					vkbd_mouse_move(vkbd, ev->devev->x, ev->devev->y);
-				}
-				break;
-			case DEV_MOUSE_MOVE_ABS:
-				vkbd_mouse_move_abs(vkbd, ev->devev->x, ev->devev->y);
-				break;
-			case DEV_LED:
-				if (ev->devev->code <= LED_MAX) {
-					ev->dev->led_state[ev->devev->code] = ev->devev->pressed;
-					// Restore layer indicator state
-					if (ev->devev->code == kbd->config.layer_indicator)
-						activate_leds(kbd);
-				}
-				break;
-			default:
-				break;
-			case DEV_MOUSE_SCROLL:
-				while (active_kbd && (ev->devev->x || ev->devev->y)) {
-					kev.pressed = 1;
-					kev.timestamp = ev->timestamp;
-
-					if (ev->devev->x > 0)
-						kev.code = KEYD_WHEELLEFT, ev->devev->x--;
-					else if (ev->devev->x < 0)
-						kev.code = KEYD_WHEELRIGHT, ev->devev->x++;
-					else if (ev->devev->y > 0)
-						kev.code = KEYD_WHEELUP, ev->devev->y--;
-					else if (ev->devev->y < 0)
-						kev.code = KEYD_WHEELDOWN, ev->devev->y++;
-
-					kbd_process_events(kbd, &kev, 1);
-
-					kev.pressed = 0;
-					// TODO: is it OK to just overwrite timeout?
-					timeout = kbd_process_events(kbd, &kev, 1);
+					if (kept)
+						vkbd_send_frame(out->vkbd, ev->dev->fd, evs, kept);
+					break;
 				}
-				break;
-			}
-		} else if (ev->dev->is_virtual && ev->devev->type == DEV_LED) {
-			/*
-			 * Propagate LED events received by the virtual device from userspace
-			 * to all grabbed devices.
-			 */
-			for (auto& dev : device_table) {
-				if (dev.fd <= 0)
+				case DEV_MOUSE_MOVE_ABS:
+					vkbd_mouse_move_abs(out->vkbd, devev->x, devev->y);
 					break;
-				if (dev.data && (dev.capabilities & CAP_LEDS)) {
-					struct keyboard* kbd = (struct keyboard*)dev.data;
-					if (ev->devev->code <= LED_MAX) {
-						// Save LED state for restoring it later
-						auto prev = std::exchange(dev.led_state[ev->devev->code], ev->devev->pressed);
-						if (prev == ev->devev->pressed)
+				case DEV_RESYNC: {
+					uint8_t state[KEY_MAX / 8 + 1];
+					if (device_read_keys(ev->dev, state) < 0)
+						break;
+
+					keyd_log("DEVICE: y{WARNING} events dropped by %s, resynchronizing\n", ev->dev->name);
+
+					// Replay transitions of this device lost in the dropped frames
+					for (uint16_t code = 1; code < KEY_CNT; code++) {
+						const uint8_t bit = 1 << (code % 8);
+						const bool down = state[code / 8] & bit;
+						if (bool(ev->dev->keys[code / 8] & bit) == down)
+							continue;
+						// Unbound buttons of passthrough devices are only in keys[] while routed
+						if (ev->dev->passthrough && code >= BTN_MISC && code < KEY_OK && !down &&
+						    !config_binds_code(&kbd->config, code))
 							continue;
+
+						ev->dev->keys[code / 8] ^= bit;
+						kevs[nr_kevs].code = code;
+						kevs[nr_kevs].pressed = down;
+						kevs[nr_kevs].timestamp = devev->timestamp;
+						if (++nr_kevs == ARRAY_SIZE(kevs))
+							process_events(kbd, kevs, std::exchange(nr_kevs, 0), true);
 					}
-					if (ev->devev->code == kbd->config.layer_indicator) {
-						// Suppress indicator change
-						continue;
+					break;
+				}
+				case DEV_LED:
+					if (devev->code <= LED_MAX) {
+						ev->dev->led_state[devev->code] = devev->pressed;
+						// Restore layer indicator state
+						if (devev->code == kbd->config.layer_indicator)
+							activate_leds(kbd);
 					}
-					device_set_led(&dev, ev->devev->code, ev->devev->pressed);
+					break;
+				default:
+					break;
+				case DEV_MOUSE_SCROLL:
+					// Each whole detent is a wheel key tap, batched with the following keys.
+					// A change of direction drops the partial detent (like hid-logitech-hidpp).
+					if ((kbd->wheel_x ^ devev->x) < 0)
+						kbd->wheel_x = 0;
+					if ((kbd->wheel_y ^ devev->y) < 0)
+						kbd->wheel_y = 0;
+					kbd->wheel_x += devev->x;
+					kbd->wheel_y += devev->y;
+
+					while (1) {
+						uint16_t code;
+
+						if (kbd->wheel_x >= WHEEL_DETENT)
+							code = KEYD_WHEELLEFT, kbd->wheel_x -= WHEEL_DETENT;
+						else if (kbd->wheel_x <= -WHEEL_DETENT)
+							code = KEYD_WHEELRIGHT, kbd->wheel_x += WHEEL_DETENT;
+						else if (kbd->wheel_y >= WHEEL_DETENT)
+							code = KEYD_WHEELUP, kbd->wheel_y -= WHEEL_DETENT;
+						else if (kbd->wheel_y <= -WHEEL_DETENT)
+							code = KEYD_WHEELDOWN, kbd->wheel_y += WHEEL_DETENT;
+						else
+							break;
+
+						if (nr_kevs + 2 > ARRAY_SIZE(kevs))
+							process_events(kbd, kevs, std::exchange(nr_kevs, 0), true);
+
+						for (uint8_t pressed : {1, 0}) {
+							kevs[nr_kevs].code = code;
+							kevs[nr_kevs].pressed = pressed;
+							kevs[nr_kevs].timestamp = devev->timestamp;
+							nr_kevs++;
+						}
+					}
+					break;
 				}
+			}
 
+			if (nr_kevs)
+				process_events(kbd, kevs, nr_kevs, true);
+		} else if (ev->dev->is_virtual) {
+			for (size_t j = 0; j < ev->nr_devev; j++) {
+				struct device_event *devev = &ev->devev[j];
+
+				if (devev->type != DEV_LED)
+					continue;
+
+				/*
+				 * Propagate LED events received by the virtual device from userspace
+				 * to all grabbed devices.
+				 */
+				for (auto& dev : device_table) {
+					if (dev->data && dev->grabbed && (dev->capabilities & CAP_LEDS)) {
+						struct keyboard* kbd = (struct keyboard*)dev->data;
+						if (devev->code <= LED_MAX) {
+							// Save LED state for restoring it later
+							auto prev = std::exchange(dev->led_state[devev->code], devev->pressed);
+							if (prev == devev->pressed)
+								continue;
+						}
+						if (devev->code == kbd->config.layer_indicator) {
+							// Suppress indicator change
+							continue;
+						}
+						device_set_led(dev.get(), devev->code, devev->pressed);
+					}
+
+				}
 			}
-			break;
 		}
 
 		break;
@@ -738,6 +1099,7 @@ static int event_handler(struct event *ev)
 		break;
 	case EV_DEV_REMOVE:
 		keyd_log("DEVICE: r{removed}\t%s %s\n", ev->dev->id, ev->dev->name);
+		remove_source(ev->dev);
 
 		break;
 	case EV_FD_ACTIVITY:
@@ -749,8 +1111,13 @@ static int event_handler(struct event *ev)
 		break;
 	}
 
-	vkbd_flush(vkbd);
-	return timeout;
+	flush_outputs();
+
+	int64_t deadline = next_deadline();
+	if (ipc_macro.cursor.active() && (!deadline || ipc_macro.resume < deadline))
+		deadline = ipc_macro.resume;
+
+	return deadline;
 }
 
 #ifndef VERSION
@@ -763,7 +1130,7 @@ int run_daemon(int, char *[])
 	if (ipcfd < 0)
 		die("failed to create socket (another instance already running?)");
 
-	vkbd = vkbd_init(VKBD_NAME);
+	out = get_output(VKBD_NAME);
 
 	setvbuf(stdout, NULL, _IOLBF, 0);
 	setvbuf(stderr, NULL, _IOLBF, 0);
@@ -775,6 +1142,7 @@ int run_daemon(int, char *[])
 
 	evloop_add_fd(ipcfd);
 
+	device_set_filter(filter_device);
 	reload({});
 
 	atexit(cleanup);
@@ -17,31 +17,40 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <sys/inotify.h>
+#include <algorithm>
 #include <numeric>
+#include <utility>
 #include "concat.hpp"
 
+#ifndef input_event_sec
+#define input_event_sec time.tv_sec
+#define input_event_usec time.tv_usec
+#endif
+
 /*
  * Abstract away evdev and inotify.
  *
- * We could make this cleaner by creating a single file descriptor via epoll
- * but this would break FreeBSD compatibility without a dedicated kqueue
- * implementation. A thread based approach was also considered, but
+ * The event loop multiplexes these descriptors with epoll (provided by
+ * epoll-shim on FreeBSD). A thread based approach was also considered, but
  * inter-thread communication adds too much overhead (~100us).
  *
  * Overview:
  *
  * A 'devmon' is a file descriptor which can be created with devmon_create()
- * and subsequently monitored for new devices read with devmon_read_device().
+ * and subsequently monitored for new device nodes queued with devmon_read().
+ * Queued nodes are probed one at a time with devmon_read_device(), so that
+ * the event loop can service input in between when many nodes appear at once
+ * (e.g. a hub being re-enumerated).
  *
  * A 'device' always corresponds to a keyboard or mouse from which activity can
  * be monitored with device->fd and events subsequently read using
- * device_read_event().
+ * device_read_events().
  *
- * If the event returned by device_read_event() is of type DEV_REMOVED then the
+ * If an event returned by device_read_events() is of type DEV_REMOVED then the
  * corresponding device should be considered invalid by the caller.
  */
 
-static uint8_t resolve_device_capabilities(int fd, uint32_t *num_keys, uint8_t *relmask, uint8_t *absmask)
+static uint8_t derive_capabilities(const uint32_t (&mask)[BTN_LEFT/32+1], uint8_t relmask, uint8_t absmask, uint8_t led_caps)
 {
 	const uint32_t keyboard_mask = 1<<KEY_1  | 1<<KEY_2 | 1<<KEY_3 |
 					1<<KEY_4 | 1<<KEY_5 | 1<<KEY_6 |
@@ -50,11 +59,42 @@ static uint8_t resolve_device_capabilities(int fd, uint32_t *num_keys, uint8_t *
 					1<<KEY_E | 1<<KEY_R | 1<<KEY_T |
 					1<<KEY_Y;
 
-	size_t i;
-	uint32_t mask[BTN_LEFT/32+1] = {0};
 	uint8_t capabilities = 0;
 	int has_brightness_key, has_volume_key;
 
+	if (relmask || absmask)
+		capabilities |= CAP_MOUSE;
+
+	if (absmask)
+		capabilities |= CAP_MOUSE_ABS;
+
+	if (led_caps)
+		capabilities |= CAP_LEDS;
+
+	/*
+	 * If the device can emit KEY_BRIGHTNESSUP or KEY_VOLUMEUP, we treat it as a keyboard.
+	 *
+	 * This is mainly to accommodate laptops with brightness/volume buttons which create
+	 * a different device node from the main keyboard for some hotkeys.
+	 *
+	 * NOTE: This will subsume anything that can emit a brightness key and may produce
+	 * false positives which need to be explcitly excluded by the user if they use
+	 * the wildcard id.
+	 */
+	has_brightness_key = mask[KEY_BRIGHTNESSUP/32] & (1 << (KEY_BRIGHTNESSUP % 32));
+	has_volume_key = mask[KEY_VOLUMEUP/32] & (1 << (KEY_VOLUMEUP % 32));
+
+	if (((mask[0] & keyboard_mask) == keyboard_mask) || has_brightness_key || has_volume_key)
+		capabilities |= CAP_KEYBOARD;
+
+	return capabilities;
+}
+
+static uint8_t resolve_device_capabilities(int fd, uint32_t *num_keys, uint8_t *relmask, uint8_t *absmask)
+{
+	size_t i;
+	uint32_t mask[BTN_LEFT/32+1] = {0};
+
 	if (ioctl(fd, EVIOCGBIT(EV_KEY, (BTN_LEFT/32+1)*4), mask) < 0) {
 		perror("ioctl: ev_key");
 		return 0;
@@ -80,32 +120,112 @@ static uint8_t resolve_device_capabilities(int fd, uint32_t *num_keys, uint8_t *
 	for (i = 0; i < sizeof(mask)/sizeof(mask[0]); i++)
 		*num_keys += __builtin_popcount(mask[i]);
 
-	if (*relmask || *absmask)
-		capabilities |= CAP_MOUSE;
+	return derive_capabilities(mask, *relmask, *absmask, led_caps);
+}
 
-	if (*absmask)
-		capabilities |= CAP_MOUSE_ABS;
+/*
+ * Parse a sysfs capability bitmap (hex words, most significant first) into
+ * 32 bit words starting from bit 0. Returns false if it can't be read.
+ */
+static bool read_sysfs_bitmap(const char *path, uint32_t *bits, size_t nr)
+{
+	char buf[1024];
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+
+	ssize_t sz = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (sz <= 0)
+		return false;
+
+	buf[sz] = 0;
+	std::string_view s(buf, strcspn(buf, "\n"));
+	std::fill_n(bits, nr, 0);
+
+	// All words but the first one are zero padded, so digits can be consumed in sequence
+	size_t bit = 0;
+	while (!s.empty()) {
+		auto word = s.substr(s.find_last_of(' ') + 1);
+		s.remove_suffix(std::min(s.size(), word.size() + 1));
+
+		// Consume the word from its least significant digit
+		for (size_t i = word.size(); i--; bit += 4) {
+			int x = isdigit(word[i]) ? word[i] - '0' : (word[i] | 0x20) - 'a' + 10;
+			if (x < 0 || x > 15)
+				return false;
+			if (bit / 32 < nr)
+				bits[bit / 32] |= uint32_t(x) << (bit % 32);
+		}
+	}
 
-	if (led_caps)
-		capabilities |= CAP_LEDS;
+	return true;
+}
 
-	/*
-	 * If the device can emit KEY_BRIGHTNESSUP or KEY_VOLUMEUP, we treat it as a keyboard.
-	 *
-	 * This is mainly to accommodate laptops with brightness/volume buttons which create
-	 * a different device node from the main keyboard for some hotkeys.
-	 *
-	 * NOTE: This will subsume anything that can emit a brightness key and may produce
-	 * false positives which need to be explcitly excluded by the user if they use
-	 * the wildcard id.
-	 */
-	has_brightness_key = mask[KEY_BRIGHTNESSUP/32] & (1 << (KEY_BRIGHTNESSUP % 32));
-	has_volume_key = mask[KEY_VOLUMEUP/32] & (1 << (KEY_VOLUMEUP % 32));
+static bool read_sysfs_hex(const char *path, uint16_t *value)
+{
+	uint32_t bits[1];
+	if (!read_sysfs_bitmap(path, bits, 1))
+		return false;
 
-	if (((mask[0] & keyboard_mask) == keyboard_mask) || has_brightness_key || has_volume_key)
-		capabilities |= CAP_KEYBOARD;
+	*value = bits[0];
+	return true;
+}
 
-	return capabilities;
+/*
+ * Read the identity and capabilities of /dev/input/event<num> from sysfs
+ * without opening the node. Returns -1 if they are unavailable (e.g. on
+ * FreeBSD), in which case the node has to be probed.
+ */
+static int read_device_info(uint32_t num, struct device_info *info)
+{
+	uint32_t mask[BTN_LEFT/32+1];
+	uint32_t rel, abs, led;
+	char name[96] = {};
+
+	auto dir = concat("/sys/class/input/event", num, "/device/");
+	auto path = [&](const char *file) { return concat(dir.get(), file); };
+
+	if (!read_sysfs_bitmap(path("capabilities/key").c_str(), mask, ARRAY_SIZE(mask)) ||
+	    !read_sysfs_bitmap(path("capabilities/rel").c_str(), &rel, 1) ||
+	    !read_sysfs_bitmap(path("capabilities/abs").c_str(), &abs, 1) ||
+	    !read_sysfs_bitmap(path("capabilities/led").c_str(), &led, 1) ||
+	    !read_sysfs_hex(path("id/vendor").c_str(), &info->vendor) ||
+	    !read_sysfs_hex(path("id/product").c_str(), &info->product))
+		return -1;
+
+	if (int fd = open(path("name").c_str(), O_RDONLY | O_CLOEXEC); fd >= 0) {
+		if (read(fd, name, sizeof(name) - 1) < 0)
+			name[0] = 0;
+		close(fd);
+	}
+
+	info->capabilities = derive_capabilities(mask, rel & 0xff, abs & 0xff, led & 0xff);
+	info->is_virtual = std::string_view(name).starts_with(VKBD_NAME);
+	return 0;
+}
+
+static device_filter filter;
+
+// Nodes rejected by the filter, reconsidered by device_rescan()
+static std::vector<uint32_t> filtered;
+
+void device_set_filter(device_filter f)
+{
+	filter = f;
+}
+
+/* Returns true if the node should be opened. */
+static bool check_filter(uint32_t num)
+{
+	struct device_info info;
+
+	if (!filter || read_device_info(num, &info) < 0 || filter(&info))
+		return true;
+
+	dbg2("skipping /dev/input/event%u (%04x:%04x)", num, info.vendor, info.product);
+	filtered.push_back(num);
+	return false;
 }
 
 uint32_t generate_uid(uint32_t num_keys, uint8_t absmask, uint8_t relmask, const char *name)
@@ -132,7 +252,7 @@ static int device_init(struct device *dev)
 {
 	int fd;
 	int capabilities;
-	uint32_t num_keys;
+	uint32_t num_keys = 0;
 	uint8_t relmask;
 	uint8_t absmask;
 	struct input_absinfo absinfo;
@@ -145,6 +265,10 @@ static int device_init(struct device *dev)
 
 	capabilities = resolve_device_capabilities(fd, &num_keys, &relmask, &absmask);
 
+	// Kernel timestamps are used for timing decisions, read time is a fallback
+	int clk = CLOCK_MONOTONIC;
+	dev->_monotonic = ioctl(fd, EVIOCSCLOCKID, &clk) == 0;
+
 	memset(dev->name, 0, sizeof(dev->name));
 	if (ioctl(fd, EVIOCGNAME(sizeof(dev->name) - 1), dev->name) == -1) {
 		keyd_log("ERROR: could not fetch device name of /dev/input/event%u\n", dev->num);
@@ -193,6 +317,22 @@ static int device_init(struct device *dev)
 		dev->capabilities = capabilities;
 		dev->data = NULL;
 		dev->grabbed = 0;
+		dev->grab_pending = 0;
+		dev->_nr_buf = 0;
+		dev->_dropped = 0;
+		dev->_mask = 0;
+		dev->passthrough = 0;
+		dev->nr_raw = 0;
+		memset(dev->keys, 0, sizeof dev->keys);
+
+		// Devices with high resolution wheels report detents in both
+		uint8_t rel[REL_CNT / 8 + 1]{};
+		ioctl(fd, EVIOCGBIT(EV_REL, sizeof rel), rel);
+		dev->_hires_wheel = 0;
+		if (rel[REL_WHEEL_HI_RES / 8] & (1 << (REL_WHEEL_HI_RES % 8)))
+			dev->_hires_wheel |= 1;
+		if (rel[REL_HWHEEL_HI_RES / 8] & (1 << (REL_HWHEEL_HI_RES % 8)))
+			dev->_hires_wheel |= 2;
 
 		dev->is_virtual = std::string_view(dev->name).starts_with(VKBD_NAME);
 		return 0;
@@ -204,7 +344,7 @@ static int device_init(struct device *dev)
 	return -1;
 }
 
-size_t device_scan(std::array<device, 128>& devices)
+void device_scan(std::vector<std::unique_ptr<device>>& devices)
 {
 	DIR *dh = opendir("/dev/input/");
 	if (!dh) {
@@ -212,22 +352,16 @@ size_t device_scan(std::array<device, 128>& devices)
 		exit(-1);
 	}
 
-	size_t n = 0;
 	while (struct dirent* ent = readdir(dh)) {
 		if (ent->d_type != DT_DIR && !memcmp(ent->d_name, "event", 5)) {
-			if (n >= devices.size()) {
-				keyd_log("Too many devices, ignoring.\n");
-				break;
-			}
-			auto& dev = devices[n];
-			dev.num = atoi(ent->d_name + 5);
-			if (device_init(&dev) >= 0)
-				n++;
+			auto dev = std::make_unique<device>();
+			dev->num = atoi(ent->d_name + 5);
+			if (check_filter(dev->num) && device_init(dev.get()) >= 0)
+				devices.emplace_back(std::move(dev));
 		}
 	}
 
 	closedir(dh);
-	return n;
 }
 
 /*
@@ -256,77 +390,109 @@ int devmon_create()
 	return fd;
 }
 
+// Nodes announced by the monitor which have not been probed yet
+static std::vector<uint32_t> devmon_queue;
+
 /*
- * A non blocking call which returns any devices available on the provided
- * monitor descriptor. Returns 0 on success.
+ * A non blocking call which queues any nodes announced on the provided
+ * monitor descriptor. Returns the number of queued nodes.
  */
-int devmon_read_device(int fd, struct device *dev)
+size_t devmon_read(int fd)
 {
-	static char buf[4096];
-	static int buf_sz = 0;
-	static char *ptr = buf;
-
-	while (1) {
-		struct inotify_event *ev;
-
-		if (ptr >= (buf+buf_sz)) {
-			ptr = buf;
-			buf_sz = read(fd, buf, sizeof(buf));
-			if (buf_sz == -1) {
-				buf_sz = 0;
-				return -1;
-			}
+	alignas(struct inotify_event) char buf[4096];
+	ssize_t sz;
+
+	while ((sz = read(fd, buf, sizeof(buf))) > 0) {
+		for (char *ptr = buf; ptr < buf + sz;) {
+			struct inotify_event *ev = (struct inotify_event*)ptr;
+			ptr += sizeof(struct inotify_event) + ev->len;
+
+			if (strncmp(ev->name, "event", 5))
+				continue;
+
+			uint32_t num = atoi(ev->name + 5);
+			if (std::find(devmon_queue.begin(), devmon_queue.end(), num) == devmon_queue.end())
+				devmon_queue.push_back(num);
 		}
+	}
 
-		ev = (struct inotify_event*)ptr;
-		ptr += sizeof(struct inotify_event) + ev->len;
+	return devmon_queue.size();
+}
 
-		if (strncmp(ev->name, "event", 5))
-			continue;
+size_t devmon_pending()
+{
+	return devmon_queue.size();
+}
 
-		dev->num = atoi(ev->name + 5);
-		if (!device_init(dev))
-			return 0;
+/*
+ * Probe the oldest queued node. Returns 0 if it yielded a device, -1
+ * otherwise (including when the queue is empty).
+ */
+int devmon_read_device(struct device *dev)
+{
+	if (devmon_queue.empty())
+		return -1;
+
+	dev->num = devmon_queue.front();
+	devmon_queue.erase(devmon_queue.begin());
+	std::erase(filtered, dev->num);
+
+	if (!check_filter(dev->num))
+		return -1;
+
+	return device_init(dev);
+}
+
+/* Queue the nodes rejected by the filter to be reconsidered (e.g. after the filter changed). */
+void device_rescan()
+{
+	for (uint32_t num : std::exchange(filtered, {})) {
+		if (access(concat("/dev/input/event", num).c_str(), F_OK) == 0 &&
+		    std::find(devmon_queue.begin(), devmon_queue.end(), num) == devmon_queue.end())
+			devmon_queue.push_back(num);
 	}
 }
 
+int64_t get_time_us()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return int64_t(ts.tv_sec) * 1000'000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Grab the device once it reaches a neutral key state, so that residual key
+ * up events propagate to the current reader. Returns 1 while keys are still
+ * held, in which case the device is marked grab_pending and the caller should
+ * retry on its next activity. Returns 0 once grabbed and -1 on failure.
+ */
 int device_grab(struct device *dev)
 {
 	struct input_event ev;
 	uint8_t state[KEY_MAX / 8 + 1]{};
-	int pending_release = 0;
 
 	if (dev->grabbed)
 		return 0;
 
-	/*
-	 * await neutral key state to ensure any residual
-	 * key up events propagate.
-	 */
-
-	for (size_t i = 0; i < 1000; i++) {
-		if (ioctl(dev->fd, EVIOCGKEY(sizeof state), state) < 0) {
-			perror("ioctl EVIOCGKEY");
-			return -1;
-		}
-
-		pending_release = std::accumulate(+state, std::end(state), 0);
-		if (!pending_release)
-			break;
-		usleep(10'000);
+	if (device_read_keys(dev, state) < 0) {
+		dev->grab_pending = 0;
+		return -1;
 	}
 
-	if (pending_release) {
-		for (size_t i = 0; i <= KEY_MAX; i++) {
-			if ((state[i / 8] >> (i % 8)) & 0x1)
-				printf("Waiting for key %s...\n", KEY_NAME(i));
+	if (std::accumulate(+state, std::end(state), 0)) {
+		if (!dev->grab_pending) {
+			for (size_t i = 0; i <= KEY_MAX; i++) {
+				if ((state[i / 8] >> (i % 8)) & 0x1)
+					printf("Waiting for key %s...\n", KEY_NAME(i));
+			}
 		}
 
-		//Allow the key up events to propagate before
-		//grabbing the device.
-		usleep(50'000);
+		dev->grab_pending = 1;
+		return 1;
 	}
 
+	dev->grab_pending = 0;
+
 	if (dev->capabilities & CAP_LEDS && ioctl(dev->fd, EVIOCGLED(LED_CNT), dev->led_state) < 0) {
 		perror("EVIOCGLED");
 		return -1;
@@ -341,12 +507,25 @@ int device_grab(struct device *dev)
 	while (read(dev->fd, &ev, sizeof(ev)) > 0) {
 	}
 
+	dev->_nr_buf = 0;
+	dev->_dropped = 0;
 	dev->grabbed = 1;
 	return 0;
 }
 
+int device_read_keys(const struct device *dev, uint8_t (&state)[KEY_MAX / 8 + 1])
+{
+	if (ioctl(dev->fd, EVIOCGKEY(sizeof state), state) < 0) {
+		perror("ioctl EVIOCGKEY");
+		return -1;
+	}
+
+	return 0;
+}
+
 int device_ungrab(struct device *dev)
 {
+	dev->grab_pending = 0;
 	if (!dev->grabbed)
 		return 0;
 
@@ -364,37 +543,144 @@ int device_ungrab(struct device *dev)
 	}
 }
 
+enum {
+	MASK_NONE,
+	MASK_IDLE,
+	MASK_LED,
+	MASK_PENDING,
+	MASK_GRABBED,
+	MASK_RAW,
+};
+
+static void set_mask(int fd, uint16_t type, const void *codes, size_t size)
+{
+#ifdef EVIOCSMASK
+	struct input_mask mask;
+	mask.type = type;
+	mask.codes_size = size;
+	mask.codes_ptr = (uintptr_t)codes;
+
+	if (ioctl(fd, EVIOCSMASK, &mask) < 0)
+		dbg("EVIOCSMASK(%u) failed: %s", type, strerror(errno));
+#endif
+}
+
 /*
- * Read a device event from the given device or return
- * NULL if none are available (may happen in the
- * case of a spurious wakeup).
+ * Limit the events queued by the kernel to those consumed in the current
+ * state of the device: nothing while it is ignored, key events while a grab
+ * is pending, LED events for the virtual keyboard and everything
+ * decode_event() handles once grabbed. Must not be used by the monitor.
  */
-struct device_event *device_read_event(struct device *dev)
+void device_update_mask(struct device *dev)
 {
-	struct input_event ev;
-	static struct device_event devev;
+	uint8_t keys[KEY_CNT / 8]{};
+	uint8_t rel[REL_CNT / 8 + 1]{};
+	uint8_t abs[ABS_CNT / 8]{};
+	uint8_t leds[LED_CNT / 8 + 1]{};
+	uint8_t none[1]{};
 
-	assert(dev->fd != -1);
+	uint8_t state = MASK_IDLE;
+	if (dev->grabbed)
+		state = dev->passthrough ? MASK_RAW : MASK_GRABBED;
+	else if (dev->grab_pending)
+		state = MASK_PENDING;
+	else if (dev->is_virtual)
+		state = MASK_LED;
+
+	if (dev->_mask == state)
+		return;
+	dev->_mask = state;
+
+	if (state >= MASK_PENDING)
+		memset(keys, 0xff, sizeof keys);
+	if (state >= MASK_GRABBED || state == MASK_LED)
+		memset(leds, 0xff, sizeof leds);
+	if (state == MASK_RAW) {
+		memset(rel, 0xff, sizeof rel);
+		memset(abs, 0xff, sizeof abs);
+	} else if (state == MASK_GRABBED) {
+		for (int code : {REL_X, REL_Y, REL_WHEEL, REL_HWHEEL, REL_WHEEL_HI_RES, REL_HWHEEL_HI_RES})
+			rel[code / 8] |= 1 << (code % 8);
+		for (int code : {ABS_X, ABS_Y})
+			abs[code / 8] |= 1 << (code % 8);
+	}
+
+	set_mask(dev->fd, EV_KEY, keys, sizeof keys);
+	set_mask(dev->fd, EV_REL, rel, sizeof rel);
+	set_mask(dev->fd, EV_ABS, abs, sizeof abs);
+	set_mask(dev->fd, EV_LED, leds, sizeof leds);
+	// Scan codes and the rest are never consumed, except timestamps passed through
+	if (state == MASK_RAW) {
+		uint8_t msc[MSC_CNT / 8 + 1]{};
+		msc[MSC_TIMESTAMP / 8] |= 1 << (MSC_TIMESTAMP % 8);
+		set_mask(dev->fd, EV_MSC, msc, sizeof msc);
+	} else {
+		set_mask(dev->fd, EV_MSC, none, sizeof none);
+	}
+	set_mask(dev->fd, EV_SW, none, sizeof none);
+}
 
-	if (read(dev->fd, &ev, sizeof(ev)) < 0) {
-		if (errno == EAGAIN) {
-			return NULL;
-		} else {
-			devev.type = DEV_REMOVED;
-			return &devev;
+/* Return true if ev is forwarded verbatim instead of being decoded. */
+static bool is_raw(const struct device *dev, const struct input_event& ev)
+{
+	switch (ev.type) {
+	case EV_REL:
+		switch (ev.code) {
+		case REL_WHEEL:
+		case REL_HWHEEL:
+		case REL_WHEEL_HI_RES:
+		case REL_HWHEEL_HI_RES:
+			return !dev->remap_wheel;
+		default:
+			return true;
 		}
+	case EV_ABS:
+		return true;
+	case EV_MSC:
+		return ev.code == MSC_TIMESTAMP;
+	case EV_KEY: {
+		// Keyboard keys always go through the engine
+		if (ev.code < BTN_MISC || ev.code >= KEY_OK)
+			return false;
+
+		const int i = ev.code - BTN_MISC;
+		return !(dev->remap_buttons[i / 8] & (1 << (i % 8)));
 	}
+	default:
+		return false;
+	}
+}
 
+static bool decode_event(const struct device *dev, const struct input_event& ev, struct device_event& devev)
+{
 	switch (ev.type) {
 	case EV_REL:
 		switch (ev.code) {
 		case REL_WHEEL:
+			if (dev->_hires_wheel & 1)
+				return false;
+
 			devev.type = DEV_MOUSE_SCROLL;
-			devev.y = ev.value;
+			devev.y = ev.value * WHEEL_DETENT;
 			devev.x = 0;
 
 			break;
 		case REL_HWHEEL:
+			if (dev->_hires_wheel & 2)
+				return false;
+
+			devev.type = DEV_MOUSE_SCROLL;
+			devev.y = 0;
+			devev.x = ev.value * WHEEL_DETENT;
+
+			break;
+		case REL_WHEEL_HI_RES:
+			devev.type = DEV_MOUSE_SCROLL;
+			devev.y = ev.value;
+			devev.x = 0;
+
+			break;
+		case REL_HWHEEL_HI_RES:
 			devev.type = DEV_MOUSE_SCROLL;
 			devev.y = 0;
 			devev.x = ev.value;
@@ -412,15 +698,9 @@ struct device_event *device_read_event(struct device *dev)
 			devev.x = 0;
 
 			break;
-//		case REL_WHEEL_HI_RES:
-//			/* TODO: implement me */
-//			return NULL;
-//		case REL_HWHEEL_HI_RES:
-//			/* TODO: implement me */
-//			return NULL;
 		default:
 			dbg("Unrecognized EV_REL code: %d\n", ev.code);
-			return NULL;
+			return false;
 		}
 
 		break;
@@ -440,14 +720,14 @@ struct device_event *device_read_event(struct device *dev)
 			break;
 		default:
 			dbg("Unrecognized EV_ABS code: %x", ev.code);
-			break;
+			return false;
 		}
 
 		break;
 	case EV_KEY:
 		/* Ignore repeat events. */
 		if (ev.value == 2)
-			return NULL;
+			return false;
 
 		devev.type = DEV_KEY;
 		devev.code = ev.code;
@@ -465,10 +745,167 @@ struct device_event *device_read_event(struct device *dev)
 	default:
 		if (ev.type)
 			dbg2("unrecognized evdev event type: %d %d %d", ev.type, ev.code, ev.value);
-		return NULL;
+		return false;
 	}
 
-	return &devev;
+	return true;
+}
+
+static int64_t event_timestamp(const struct device *dev, const struct input_event& ev, int64_t now)
+{
+	if (!dev->_monotonic)
+		return now;
+
+	return int64_t(ev.input_event_sec) * 1000'000 + ev.input_event_usec;
+}
+
+/*
+ * Decode complete SYN_REPORT frames. Relative motion, wheel and absolute
+ * position updates are coalesced into a single event per frame, placed where
+ * the first one appeared to preserve ordering with buttons. The same applies
+ * to the events of a passthrough device collected into a DEV_RAW_FRAME.
+ */
+static size_t decode_frames(struct device *dev, const struct input_event *evs, size_t nr, struct device_event *devevs)
+{
+	size_t n = 0;
+	size_t frame = 0;
+	const int64_t now = dev->_monotonic ? 0 : get_time_us();
+
+	// Output slots of coalesced events in the current frame
+	int move = -1;
+	int move_abs = -1;
+	int scroll = -1;
+	int raw = -1;
+	size_t raw_frame = dev->nr_raw;
+
+	for (size_t i = 0; i < nr; i++) {
+		const struct input_event& ev = evs[i];
+		struct device_event devev{};
+
+		if (ev.type == EV_SYN) {
+			if (ev.code == SYN_DROPPED) {
+				// Discard the whole frame
+				dev->_dropped = 1;
+				n = frame;
+				dev->nr_raw = raw_frame;
+			} else if (ev.code == SYN_REPORT) {
+				if (dev->_dropped) {
+					dev->_dropped = 0;
+					devevs[n].type = DEV_RESYNC;
+					devevs[n++].timestamp = event_timestamp(dev, ev, now);
+				}
+
+				frame = n;
+				raw_frame = dev->nr_raw;
+				move = move_abs = scroll = raw = -1;
+			}
+
+			continue;
+		}
+
+		if (dev->_dropped)
+			continue;
+
+		if (dev->passthrough && is_raw(dev, ev)) {
+			if (raw < 0) {
+				devev.type = DEV_RAW_FRAME;
+				devev.code = dev->nr_raw;
+				devev.timestamp = event_timestamp(dev, ev, now);
+
+				raw = n;
+				devevs[n++] = devev;
+			}
+
+			dev->raw[dev->nr_raw++] = ev;
+			devevs[raw].x++;
+			continue;
+		}
+
+		if (!decode_event(dev, ev, devev))
+			continue;
+
+		devev.timestamp = event_timestamp(dev, ev, now);
+
+		int *slot = nullptr;
+		switch (devev.type) {
+		case DEV_MOUSE_MOVE:
+			slot = &move;
+			break;
+		case DEV_MOUSE_MOVE_ABS:
+			slot = &move_abs;
+			break;
+		case DEV_MOUSE_SCROLL:
+			slot = &scroll;
+			break;
+		default:
+			break;
+		}
+
+		if (slot && *slot >= 0) {
+			auto& prev = devevs[*slot];
+			if (devev.type != DEV_MOUSE_MOVE_ABS) {
+				prev.x += devev.x;
+				prev.y += devev.y;
+			} else if (ev.code == ABS_X) {
+				prev.x = devev.x;
+			} else {
+				prev.y = devev.y;
+			}
+
+			continue;
+		}
+
+		if (slot)
+			*slot = n;
+		devevs[n++] = devev;
+	}
+
+	return n;
+}
+
+/*
+ * Drain pending events from the given device with a single read() into its
+ * buffer and decode all complete frames into devevs (which must hold at least
+ * MAX_DEVICE_EVENTS entries). Returns the number of decoded events or 0 if
+ * none are available (may happen in the case of a spurious wakeup). A
+ * DEV_REMOVED event is always returned on its own.
+ */
+size_t device_read_events(struct device *dev, struct device_event *devevs)
+{
+	size_t n = 0;
+
+	assert(dev->fd != -1);
+
+	dev->nr_raw = 0;
+	while (!n) {
+		ssize_t rd = read(dev->fd, dev->_buf + dev->_nr_buf, sizeof(dev->_buf) - dev->_nr_buf * sizeof(dev->_buf[0]));
+		if (rd < 0) {
+			if (errno == EAGAIN)
+				return 0;
+
+			devevs[0].type = DEV_REMOVED;
+			return 1;
+		}
+
+		if (rd == 0)
+			return 0;
+
+		const size_t end = dev->_nr_buf + rd / sizeof(dev->_buf[0]);
+		size_t complete = end;
+
+		// Hold back a trailing incomplete frame unless it fills the whole buffer
+		while (complete && (dev->_buf[complete - 1].type != EV_SYN || dev->_buf[complete - 1].code != SYN_REPORT))
+			complete--;
+		if (!complete && end == MAX_DEVICE_EVENTS)
+			complete = end;
+
+		n = decode_frames(dev, dev->_buf, complete, devevs);
+
+		memmove(dev->_buf, dev->_buf + complete, (end - complete) * sizeof(dev->_buf[0]));
+		dev->_nr_buf = end - complete;
+	}
+
+	return n;
 }
 
 void device_set_led(const struct device *dev, uint8_t led, int state)
@@ -8,22 +8,43 @@
 
 #include <stdint.h>
 #include <array>
+#include <memory>
+#include <vector>
+
+#ifdef __FreeBSD__
+	#include <dev/evdev/input.h>
+#else
+	#include <linux/input.h>
+#endif
+
+#ifndef REL_WHEEL_HI_RES
+#define REL_WHEEL_HI_RES	0x0b
+#define REL_HWHEEL_HI_RES	0x0c
+#endif
+
+/* High resolution wheel units per detent (as used by REL_WHEEL_HI_RES). */
+#define WHEEL_DETENT	120
 
 #define CAP_MOUSE	0x1
 #define CAP_MOUSE_ABS	0x2
 #define CAP_KEYBOARD	0x4
 #define CAP_LEDS	0x8
 
+/* Maximum number of input events drained by a single read(). */
+#define MAX_DEVICE_EVENTS	64
+
 struct device {
 	/*
 	 * A file descriptor that can be used to monitor events subsequently read with
-	 * device_read_event().
+	 * device_read_events().
 	 */
 	int fd;
 
 	uint8_t grabbed : 1;
+	/* Waiting for all keys to be released before grabbing. */
+	uint8_t grab_pending : 1;
 	uint8_t is_virtual : 1;
-	uint8_t capabilities : 6;
+	uint8_t capabilities : 5;
 
 	char id[23];
 	uint32_t num;
@@ -31,11 +52,40 @@ struct device {
 
 	uint8_t led_state[LED_CNT];
 
+	/*
+	 * Set by the user: pointer events of the device are returned verbatim
+	 * (DEV_RAW_FRAME), except for the buttons in remap_buttons and the
+	 * wheel if remap_wheel is set.
+	 */
+	uint8_t passthrough;
+	uint8_t remap_wheel;
+	uint8_t remap_buttons[(KEY_OK - BTN_MISC) / 8];
+
+	/* Keys of this device held down in the engine, maintained by the user. */
+	uint8_t keys[KEY_MAX / 8 + 1];
+
+	/* Events referenced by DEV_RAW_FRAME, valid until the next read. */
+	struct input_event raw[MAX_DEVICE_EVENTS];
+	uint8_t nr_raw;
+
 	/* Internal. */
 	uint32_t _maxx;
 	uint32_t _maxy;
 	uint32_t _minx;
 	uint32_t _miny;
+	uint32_t _events; /* Event loop interest mask. */
+
+	/* Events of an incomplete frame held back until SYN_REPORT. */
+	struct input_event _buf[MAX_DEVICE_EVENTS];
+	uint8_t _nr_buf;
+	/* Set after SYN_DROPPED until the next SYN_REPORT. */
+	uint8_t _dropped;
+	/* Event timestamps use CLOCK_MONOTONIC. */
+	uint8_t _monotonic;
+	/* Event mask installed with device_update_mask(). */
+	uint8_t _mask;
+	/* REL_WHEEL_HI_RES (1) and REL_HWHEEL_HI_RES (2) are reported. */
+	uint8_t _hires_wheel;
 
 	/* Reserved for the user. */
 	void *data;
@@ -48,7 +98,13 @@ enum class dev_event_e : signed char {
 	DEV_MOUSE_MOVE,
 	/* All absolute values are relative to a resolution of 1024x1024. */
 	DEV_MOUSE_MOVE_ABS,
+	/* In 1/WHEEL_DETENT of a detent. */
 	DEV_MOUSE_SCROLL,
+	/* Pointer events of a frame, dev->raw[code] to dev->raw[code + x - 1]. */
+	DEV_RAW_FRAME,
+
+	/* Events were lost (SYN_DROPPED), key state must be queried. */
+	DEV_RESYNC,
 
 	DEV_REMOVED,
 };
@@ -61,17 +117,36 @@ struct device_event {
 	uint16_t code;
 	int32_t x;
 	int32_t y;
+	int64_t timestamp; /* CLOCK_MONOTONIC, in microseconds */
 };
 
+/* Device properties known before the node is opened. */
+struct device_info {
+	uint16_t vendor;
+	uint16_t product;
+	uint8_t capabilities;
+	bool is_virtual;
+};
+
+/* Returns false if the device can be left unopened. */
+using device_filter = bool (*)(const struct device_info *info);
 
-struct device_event *device_read_event(struct device *dev);
+size_t device_read_events(struct device *dev, struct device_event *devevs);
 
-size_t device_scan(std::array<device, 128>& devices);
+void device_set_filter(device_filter filter);
+void device_scan(std::vector<std::unique_ptr<device>>& devices);
+void device_rescan();
 int device_grab(struct device *dev);
+int device_read_keys(const struct device *dev, uint8_t (&state)[KEY_MAX / 8 + 1]);
 int device_ungrab(struct device *dev);
+void device_update_mask(struct device *dev);
+
+int64_t get_time_us();
 
 int devmon_create();
-int devmon_read_device(int fd, struct device *dev);
+size_t devmon_read(int fd);
+size_t devmon_pending();
+int devmon_read_device(struct device *dev);
 void device_set_led(const struct device *dev, uint8_t led, int state);
 
 #endif
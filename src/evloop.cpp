@@ -1,10 +1,31 @@
 #include "keyd.h"
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
 
-static int aux_fd = -1;
+/*
+ * Every source is registered with epoll exactly once. Device entries carry the
+ * device pointer, everything else carries the fd tagged with the top bit (no
+ * valid user space pointer has it set), so dispatch only touches ready fds.
+ */
+static constexpr uint64_t fd_tag = uint64_t(1) << 63;
 
-// Expected to be initialized as zeros
-// Expected to terminate if fd 0 or -1
-std::array<device, 128> device_table{};
+static int epfd = -1;
+
+// Devices are heap allocated to keep pointers stable while the table grows
+std::vector<std::unique_ptr<device>> device_table;
+
+static int evloop_fd()
+{
+	if (epfd < 0) {
+		epfd = epoll_create1(EPOLL_CLOEXEC);
+		if (epfd < 0) {
+			perror("epoll_create1");
+			exit(-1);
+		}
+	}
+
+	return epfd;
+}
 
 static void panic_check(const device_event* ev)
 {
@@ -27,140 +48,218 @@ static void panic_check(const device_event* ev)
 		die("panic sequence detected");
 }
 
-static int64_t get_time_ms()
+/* Arm the timer with an absolute CLOCK_MONOTONIC deadline in microseconds (0 disarms). */
+static void arm_timer(int tfd, int64_t deadline)
 {
-	struct timespec ts;
-	clock_gettime(CLOCK_MONOTONIC, &ts);
-	return int64_t(ts.tv_sec) * 1000 + ts.tv_nsec / 1000'000;
+	struct itimerspec its{};
+	its.it_value.tv_sec = deadline / 1000'000;
+	its.it_value.tv_nsec = deadline % 1000'000 * 1000;
+
+	if (timerfd_settime(tfd, TFD_TIMER_ABSTIME, &its, nullptr) < 0)
+		perror("timerfd_settime");
 }
 
-int evloop(int (*event_handler)(struct event* ev), bool monitor)
+static uint32_t device_events(const struct device *dev, bool monitor)
 {
-	size_t n_dev;
-	int timeout = 0;
-	int monfd;
+	if (monitor || dev->grabbed || dev->grab_pending)
+		return EPOLLIN;
+	if (dev->capabilities & CAP_KEYBOARD && dev->is_virtual)
+		return EPOLLIN;
+
+	// Errors and hangups are always reported
+	return 0;
+}
 
-	struct pollfd pfds[device_table.size() + 3]{};
+static void register_device(struct device *dev, bool monitor)
+{
+	struct epoll_event ee{};
+	ee.events = dev->_events = device_events(dev, monitor);
+	ee.data.ptr = dev;
+
+	if (epoll_ctl(evloop_fd(), EPOLL_CTL_ADD, dev->fd, &ee) < 0)
+		perror("epoll_ctl add");
+}
 
+/* Update interest masks of devices whose grab state may have changed. */
+static void sync_devices(bool monitor)
+{
+	for (auto& dev : device_table) {
+		struct epoll_event ee{};
+		ee.events = device_events(dev.get(), monitor);
+		ee.data.ptr = dev.get();
+
+		if (ee.events == dev->_events)
+			continue;
+		if (epoll_ctl(epfd, EPOLL_CTL_MOD, dev->fd, &ee) < 0)
+			perror("epoll_ctl mod");
+		dev->_events = ee.events;
+	}
+}
+
+static void remove_device(struct device *dev)
+{
+	epoll_ctl(epfd, EPOLL_CTL_DEL, dev->fd, nullptr);
+	close(dev->fd);
+
+	auto it = std::find_if(device_table.begin(), device_table.end(), [&](auto& p) {
+		return p.get() == dev;
+	});
+
+	// Order is irrelevant
+	std::swap(*it, device_table.back());
+	device_table.pop_back();
+}
+
+int evloop(int64_t (*event_handler)(struct event* ev), bool monitor)
+{
+	int64_t deadline = 0;
+	int64_t armed = 0;
+	int monfd;
+	int tfd;
+
+	struct epoll_event events[64];
 	struct event ev{};
 
+	evloop_fd();
 	monfd = devmon_create();
-	n_dev = device_scan(device_table);
+	evloop_add_fd(monfd);
+
+	tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (tfd < 0) {
+		perror("timerfd_create");
+		exit(-1);
+	}
+	evloop_add_fd(tfd);
+
+	// Used to handle pipe closure (fails harmlessly for regular files)
+	struct epoll_event ee{};
+	ee.events = 0;
+	ee.data.u64 = fd_tag | STDOUT_FILENO;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, STDOUT_FILENO, &ee);
+
+	/* Deliver the pending deadline if it is not later than time. */
+	auto expire = [&](int64_t time) {
+		while (deadline && deadline <= time) {
+			struct event tev{};
+			tev.type = EV_TIMEOUT;
+			tev.timestamp = deadline;
+
+			deadline = event_handler(&tev);
+		}
+	};
+
+	device_scan(device_table);
 
-	for (size_t i = 0; i < n_dev; i++) {
+	for (auto& dev : device_table) {
 		ev.type = EV_DEV_ADD;
-		ev.dev = &device_table[i];
+		ev.dev = dev.get();
+		ev.timestamp = get_time_us();
 
 		event_handler(&ev);
+		register_device(dev.get(), monitor);
 	}
 
-	pfds[0].fd = monfd;
-	pfds[0].events = POLLIN;
-	pfds[1].fd = aux_fd;
-	pfds[1].events = POLLIN;
-	pfds[2].fd = STDOUT_FILENO;
-	pfds[2].events = 0;
-	auto pfdsd = pfds + 3;
-
 	while (1) {
-		int removed = 0;
-
-		int64_t start_time;
-		int64_t elapsed;
-
-		for (size_t i = 0; i < n_dev; i++) {
-			pfdsd[i].fd = device_table[i].fd;
-			pfdsd[i].events = 0;
-			if (monitor || device_table[i].grabbed)
-				pfdsd[i].events = POLLIN;
-			else if (device_table[i].capabilities & CAP_KEYBOARD && device_table[i].is_virtual)
-				pfdsd[i].events = POLLIN;
-		}
+		bool resync = false;
 
-		start_time = get_time_ms();
-		poll(pfds, n_dev + (pfdsd - pfds), timeout > 0 ? timeout : -1);
-		ev.timestamp = get_time_ms();
-		elapsed = ev.timestamp - start_time;
-
-		if (pfds[2].revents) {
-			// Handle pipe closure
-			break;
+		if (deadline != armed) {
+			arm_timer(tfd, deadline);
+			armed = deadline;
 		}
 
-		if (timeout > 0 && elapsed >= timeout) {
-			ev.type = EV_TIMEOUT;
-			ev.dev = NULL;
-			ev.devev = NULL;
-			timeout = event_handler(&ev);
-		} else {
-			timeout -= elapsed;
+		// Only poll while nodes are waiting to be probed, so input goes first
+		int n = epoll_wait(epfd, events, ARRAY_SIZE(events), devmon_pending() ? 0 : -1);
+		if (n < 0) {
+			if (errno != EINTR) {
+				perror("epoll_wait");
+				exit(-1);
+			}
+			n = 0;
 		}
 
-		for (size_t i = 0; i < n_dev; i++) {
-			if (pfdsd[i].revents) {
-				struct device_event *devev = nullptr;
+		const int64_t now = get_time_us();
 
-				while ((pfdsd[i].revents & (POLLERR | POLLHUP)) || (devev = device_read_event(&device_table[i]))) {
-					if (!devev || devev->type == DEV_REMOVED) {
-						ev.type = EV_DEV_REMOVE;
-						ev.dev = &device_table[i];
+		for (int i = 0; i < n; i++) {
+			const uint32_t revents = events[i].events;
 
-						timeout = event_handler(&ev);
+			ev.timestamp = now;
 
-						close(device_table[i].fd);
-						device_table[i].fd = -1;
-						removed = 1;
-						break;
-					} else {
-						panic_check(devev);
+			if (!(events[i].data.u64 & fd_tag)) {
+				struct device *dev = (struct device*)events[i].data.ptr;
+				struct device_event devevs[MAX_DEVICE_EVENTS];
+				size_t nr_devev = 0;
 
-						ev.type = EV_DEV_EVENT;
-						ev.devev = devev;
-						ev.dev = &device_table[i];
+				while ((revents & (EPOLLERR | EPOLLHUP)) || (nr_devev = device_read_events(dev, devevs))) {
+					if (!nr_devev || devevs[0].type == DEV_REMOVED) {
+						ev.type = EV_DEV_REMOVE;
+						ev.dev = dev;
 
-						timeout = event_handler(&ev);
+						deadline = event_handler(&ev);
+						remove_device(dev);
+						break;
 					}
+
+					for (size_t j = 0; j < nr_devev; j++)
+						panic_check(&devevs[j]);
+
+					// Order expired deadlines before the input using kernel timestamps
+					expire(devevs[0].timestamp);
+
+					ev.type = EV_DEV_EVENT;
+					ev.devev = devevs;
+					ev.nr_devev = nr_devev;
+					ev.dev = dev;
+
+					deadline = event_handler(&ev);
 				}
+
+				continue;
 			}
-		}
 
-		{
-			if (auto events = pfds[1].revents) {
-				ev.type = events & POLLERR ? EV_FD_ERR : EV_FD_ACTIVITY;
-				ev.fd = aux_fd;
+			const int fd = events[i].data.u64 & ~fd_tag;
 
-				timeout = event_handler(&ev);
+			if (fd == STDOUT_FILENO) {
+				// Handle pipe closure
+				return 0;
 			}
-		}
 
-		if (pfds[0].revents) {
-			struct device dev;
-
-			while (devmon_read_device(monfd, &dev) == 0) {
-				if (n_dev >= device_table.size()) {
-					keyd_log("Too many devices, ignoring.\n");
-					close(dev.fd);
-					break;
-				}
-				device_table[n_dev] = std::move(dev);
+			if (fd == tfd) {
+				uint64_t expirations;
+				if (read(tfd, &expirations, sizeof expirations) < 0 && errno != EAGAIN)
+					perror("read timerfd");
 
-				ev.type = EV_DEV_ADD;
-				ev.dev = &device_table[n_dev];
+				// The deadline may have moved since the timer was armed
+				expire(now);
+				continue;
+			}
 
-				timeout = event_handler(&ev);
-				n_dev++;
+			if (fd == monfd) {
+				devmon_read(monfd);
+				continue;
 			}
+
+			ev.type = revents & EPOLLERR ? EV_FD_ERR : EV_FD_ACTIVITY;
+			ev.fd = fd;
+
+			deadline = event_handler(&ev);
+
+			// Reloads may grab or release any device
+			resync = true;
 		}
 
-		if (removed) {
-			// Maintain contiguous list of devices
-			auto end = std::remove_if(device_table.begin(), device_table.begin() + n_dev, [](device& dev) {
-				return dev.fd <= 0;
-			});
-			if (end < device_table.begin() + n_dev) {
-				end->fd = -1;
-				n_dev = end - device_table.data();
-			}
+		if (resync)
+			sync_devices(monitor);
+
+		// Probe a single new node per iteration
+		if (struct device dev; devmon_read_device(&dev) == 0) {
+			auto& ptr = device_table.emplace_back(std::make_unique<device>(std::move(dev)));
+
+			ev.type = EV_DEV_ADD;
+			ev.dev = ptr.get();
+			ev.timestamp = get_time_us();
+
+			deadline = event_handler(&ev);
+			register_device(ptr.get(), monitor);
 		}
 	}
 
@@ -169,6 +268,12 @@ int evloop(int (*event_handler)(struct event* ev), bool monitor)
 
 void evloop_add_fd(int fd)
 {
-	assert(aux_fd < 0);
-	aux_fd = fd;
+	struct epoll_event ee{};
+	ee.events = EPOLLIN;
+	ee.data.u64 = fd_tag | fd;
+
+	if (epoll_ctl(evloop_fd(), EPOLL_CTL_ADD, fd, &ee) < 0) {
+		perror("epoll_ctl");
+		exit(-1);
+	}
 }
@@ -6,6 +6,8 @@
 
 #include "keyd.h"
 #include <algorithm>
+#include <functional>
+#include <utility>
 
 static int64_t process_event(struct keyboard *kbd, uint16_t code, int pressed, int64_t time);
 
@@ -13,6 +15,12 @@ static int64_t process_event(struct keyboard *kbd, uint16_t code, int pressed, i
  * Here be tiny dragons.
  */
 
+/* Engine time is in microseconds, config and descriptor timeouts are in milliseconds. */
+static constexpr int64_t ms_to_us(int64_t ms)
+{
+	return ms * 1000;
+}
+
 static int64_t get_time()
 {
 	/* Close enough :/. Using a syscall is unnecessary. */
@@ -20,41 +28,37 @@ static int64_t get_time()
 	return time++;
 }
 
-static int cache_set(struct keyboard *kbd, uint16_t code, struct cache_entry *ent)
+static struct cache_entry *cache_get(struct keyboard *kbd, uint16_t code)
 {
-	size_t i;
-	int slot = -1;
+	const uint16_t i = kbd->cache_idx[code];
 
-	for (i = 0; i < CACHE_SIZE; i++)
-		if (kbd->cache[i].code == code) {
-			slot = i;
-			break;
-		} else if (!kbd->cache[i].code) {
-			slot = i;
-		}
+	return i ? &kbd->cache[i - 1] : NULL;
+}
 
-	if (slot == -1)
-		return -1;
+static void cache_set(struct keyboard *kbd, uint16_t code, const struct cache_entry *ent)
+{
+	struct cache_entry *ce = cache_get(kbd, code);
 
-	if (ent == NULL) {
-		kbd->cache[slot].code = 0;
-	} else {
-		kbd->cache[slot] = *ent;
-		kbd->cache[slot].code = code;
+	if (!ce) {
+		ce = &kbd->cache.emplace_back();
+		kbd->cache_idx[code] = kbd->cache.size();
 	}
 
-	return 0;
+	*ce = *ent;
+	ce->code = code;
 }
 
-static struct cache_entry *cache_get(struct keyboard *kbd, uint16_t code)
+/* Remove the entry of code by moving the last one into its place. */
+static void cache_del(struct keyboard *kbd, uint16_t code)
 {
-	size_t i;
+	const uint16_t i = std::exchange(kbd->cache_idx[code], 0);
 
-	for (i = 0; i < CACHE_SIZE; i++)
-		if (kbd->cache[i].code == code)
-			return &kbd->cache[i];
+	if (i != kbd->cache.size()) {
+		kbd->cache[i - 1] = kbd->cache.back();
+		kbd->cache_idx[kbd->cache[i - 1].code] = i;
+	}
 
-	return NULL;
+	kbd->cache.pop_back();
 }
 
 static void reset_keystate(struct keyboard *kbd)
@@ -154,7 +158,7 @@ static void update_mods(struct keyboard *kbd, [[maybe_unused]] int excl, uint8_t
 		struct layer *layer = &kbd->config.layers[i];
 		size_t excluded = 0;
 
-		if (!kbd->layer_state[i].active())
+		if (!kbd->layer_active(i))
 			continue;
 
 		if (layer == excluded_layer) {
@@ -172,9 +176,9 @@ static void update_mods(struct keyboard *kbd, [[maybe_unused]] int excl, uint8_t
 			mods |= 1 << (i - 1);
 	}
 
-	for (size_t i = 0; i < CACHE_SIZE; i++) {
+	for (auto& ce : kbd->cache) {
 		// Check active keysequences for mods being active or suppressed
-		if (auto& ce = kbd->cache[i]; ce.code && ce.d.op == OP_KEYSEQUENCE) {
+		if (ce.d.op == OP_KEYSEQUENCE) {
 			if (ce.d.args[0].code == code)
 				continue;
 			uint8_t c_wildc = ce.d.args[2].wildc;
@@ -188,14 +192,12 @@ static void update_mods(struct keyboard *kbd, [[maybe_unused]] int excl, uint8_t
 
 static uint8_t get_mods(struct keyboard* kbd)
 {
-	uint8_t mods = 0;
+	// Modifier layers occupy 1..MAX_MOD
+	uint8_t mods = kbd->active_mask[0] >> 1;
 
 	for (size_t i = 0; i < MAX_MOD; i++) {
-		uint8_t mask = 1 << i;
-		if (kbd->layer_state[i + 1].active())
-			mods |= mask;
 		if (kbd->keystate[KEYD_FAKEMOD + i])
-			mods |= mask;
+			mods |= 1 << i;
 	}
 
 	return mods;
@@ -214,7 +216,22 @@ static uint8_t what_mods(struct keyboard* kbd, uint16_t code)
 	return mods;
 }
 
-static uint64_t execute_macro(struct keyboard *kbd, int16_t dl, uint16_t idx, uint16_t orig_code)
+static void schedule_timeout(struct keyboard *kbd, int64_t timeout);
+
+/* Play the current macro up to its next delay. */
+static void play_macro(struct keyboard *kbd, int64_t time)
+{
+	if (int64_t delay = macro_step(kbd->playback.cursor)) {
+		kbd->playback.resume = time + delay;
+		schedule_timeout(kbd, kbd->playback.resume);
+	} else if (kbd->active_macro >= 0 && kbd->macro_timeout < time + kbd->macro_repeat_interval) {
+		// Repeat only after the macro has been played back completely
+		kbd->macro_timeout = time + kbd->macro_repeat_interval;
+		schedule_timeout(kbd, kbd->macro_timeout);
+	}
+}
+
+static void execute_macro(struct keyboard *kbd, int16_t dl, uint16_t idx, uint16_t orig_code, int64_t time)
 {
 	auto& macro = kbd->config.macros[idx & INT16_MAX];
 	/* Minimize redundant modifier strokes for simple key sequences. */
@@ -227,34 +244,42 @@ static uint64_t execute_macro(struct keyboard *kbd, int16_t dl, uint16_t idx, ui
 		update_mods(kbd, dl, macro[0].mods.mods, macro[0].mods.wildc);
 		send_key(kbd, code, 1);
 		send_key(kbd, code, 0);
-		return 0;
 	} else {
+		// A new macro completes the one being played back without delays
+		macro_finish(kbd->playback.cursor);
+
 		// Completely disable mods if no wildcard is set
 		update_mods(kbd, dl, 0, (kbd->config.compat || idx & 0x8000) ? 0xff : 0);
-		return macro_execute(kbd->output.send_key, macro, kbd->config.macro_sequence_timeout, &kbd->config) / 1000;
+		macro_start(kbd->playback.cursor, kbd->output.send_key, macro, kbd->config.macro_sequence_timeout, &kbd->config);
+		play_macro(kbd, time);
 	}
 }
 
-static void lookup_descriptor(struct keyboard *kbd, uint16_t code, struct descriptor *d, int16_t* dl)
+/* Check whether all members of the c-th indexed composite layer are active. */
+static bool composite_active(const struct keyboard *kbd, size_t c)
 {
-	d->op = OP_NULL;
+	const size_t n = kbd->config.mask_words;
+	const uint64_t *mask = &kbd->config.composite_masks[c * n];
 
-	uint64_t maxts = 0;
+	for (size_t i = 0; i < n; i++) {
+		if (mask[i] & ~kbd->active_mask[i])
+			return false;
+	}
 
-	if (code >= KEYD_CHORD_1 && code <= KEYD_CHORD_MAX) {
-		size_t idx = code - KEYD_CHORD_1;
+	return true;
+}
 
-		*d = kbd->active_chords[idx].chord.d;
-		*dl = kbd->active_chords[idx].layer;
+static void resolve_descriptor(struct keyboard *kbd, uint16_t code, uint8_t mods, struct descriptor *d, int16_t* dl)
+{
+	d->op = OP_NULL;
 
-		return;
-	}
+	uint64_t maxts = 0;
 
 	// Synthesize default key for matching
 	descriptor desc{
 		.op = OP_KEYSEQUENCE,
 		.id = code,
-		.mods = get_mods(kbd),
+		.mods = mods,
 		.wildcard = 0,
 		.args = {},
 	};
@@ -263,46 +288,42 @@ static void lookup_descriptor(struct keyboard *kbd, uint16_t code, struct descri
 	desc.args[1].mods = desc.mods;
 	desc.args[2].wildc = 0xff;
 
-	size_t set = 0;
+	const size_t set = kbd->active_layers.size() - kbd->layer_active(0);
 	size_t max = 0;
 	size_t conflicts = 0;
 
-	for (size_t i = 0; i < kbd->config.layers.size(); i++) {
-		struct layer *layer = &kbd->config.layers[i];
+	// Most recent first, only layers activated at the same time can conflict
+	for (auto it = kbd->active_layers.rbegin(); it != kbd->active_layers.rend(); it++) {
+		const uint16_t i = *it;
+		const auto act_ts = kbd->layer_state[i].activation_time;
 
-		if (kbd->layer_state[i].active()) {
-			const auto act_ts = kbd->layer_state[i].activation_time;
-			if (i > 0)
-				kbd->active_layers[set++] = i;
-			if (act_ts < maxts)
-				continue;
-			if (auto match = layer->keymap[desc]) {
-				if (maxts < act_ts)
-					conflicts = 0;
-				maxts = act_ts;
-				max = 1;
-				// Check for conflicting matches, actual conflict discards both
-				// Deep comparison is performed to verify conflict
-				// To avoid some legitimate cases with identical ops
-				if (!conflicts || !d->equals(&kbd->config, match))
-					conflicts++;
-				*d = match;
-				*dl = i;
-			}
+		if (act_ts < maxts)
+			break;
+		if (auto match = kbd->config.layers[i].keymap[desc]) {
+			maxts = act_ts;
+			max = 1;
+			// Check for conflicting matches, actual conflict discards both
+			// Deep comparison is performed to verify conflict
+			// To avoid some legitimate cases with identical ops
+			if (!conflicts || !d->equals(&kbd->config, match))
+				conflicts++;
+			*d = match;
+			*dl = i;
 		}
 	}
 
 	/* Scan for any composite matches (which take precedence). */
-	for (size_t i = MAX_MOD + 1; i < kbd->config.layers.size(); i++) {
+	for (size_t c = 0; c < kbd->config.composites.size(); c++) {
 		if (set <= 1) [[likely]]
 			break;
+		const size_t i = kbd->config.composites[c];
 		// Optimization: don't access uninteresting layers
 		if (kbd->layer_state[i].composite == 0)
 			continue;
 		struct layer *layer = &kbd->config.layers[i];
 		if (layer->size() > set || layer->size() < max)
 			continue;
-		if (!std::includes(kbd->active_layers.begin(), kbd->active_layers.begin() + set, layer->begin(), layer->end()))
+		if (!composite_active(kbd, c))
 			continue;
 		if (auto match = layer->keymap[desc]) {
 			if (max < layer->size())
@@ -330,6 +351,55 @@ static void lookup_descriptor(struct keyboard *kbd, uint16_t code, struct descri
 	}
 }
 
+static void lookup_descriptor(struct keyboard *kbd, uint16_t code, struct descriptor *d, int16_t* dl)
+{
+	if (code >= KEYD_CHORD_1 && code <= KEYD_CHORD_MAX) {
+		size_t idx = code - KEYD_CHORD_1;
+
+		*d = kbd->active_chords[idx].chord.d;
+		*dl = kbd->active_chords[idx].layer;
+
+		return;
+	}
+
+	const uint8_t mods = get_mods(kbd);
+	const uint64_t tag = kbd->layer_tag;
+	auto& ent = kbd->lookup_cache[(code ^ mods << 1 ^ tag ^ tag >> 32) % kbd->lookup_cache.size()];
+
+	if (ent.gen != kbd->config_gen || ent.tag != tag || ent.code != code || ent.mods != mods) {
+		resolve_descriptor(kbd, code, mods, &ent.d, &ent.dl);
+		ent.tag = tag;
+		ent.gen = kbd->config_gen;
+		ent.code = code;
+		ent.mods = mods;
+	}
+
+	*d = ent.d;
+	*dl = ent.dl;
+}
+
+/* Reflect a change of layer_state[idx] in the active layer stack and mask. */
+static void sync_layer(struct keyboard *kbd, uint16_t idx)
+{
+	auto& stack = kbd->active_layers;
+	const auto& state = kbd->layer_state[idx];
+
+	if (kbd->layer_active(idx))
+		stack.erase(std::find(stack.begin(), stack.end(), idx));
+	kbd->active_mask[idx / 64] &= ~(uint64_t(1) << (idx % 64));
+
+	if (!state.active())
+		return kbd->update_layer_tag();
+
+	auto pos = std::upper_bound(stack.begin(), stack.end(), state.activation_time, [&](uint64_t ts, uint16_t i) {
+		return ts < kbd->layer_state[i].activation_time;
+	});
+
+	stack.insert(pos, idx);
+	kbd->active_mask[idx / 64] |= uint64_t(1) << (idx % 64);
+	kbd->update_layer_tag();
+}
+
 static void activate_layer(struct keyboard *kbd, uint16_t code, int idx);
 
 static void deactivate_layer(struct keyboard *kbd, int idx)
@@ -344,10 +414,12 @@ static void deactivate_layer(struct keyboard *kbd, int idx)
 	if (layer.name) {
 		dbg("Deactivating layer %s", layer.name.c_str());
 		kbd->layer_state[idx].active_s--;
+		sync_layer(kbd, idx);
 	} else {
 		for (uint16_t i : layer) {
 			dbg("Deactivating layer %s", kbd->config.layers[i].name.c_str());
 			kbd->layer_state[i].active_s--;
+			sync_layer(kbd, i);
 		}
 	}
 
@@ -376,6 +448,7 @@ static void activate_layer(struct keyboard *kbd, uint16_t code, int idx)
 		kbd->layer_state[idx].active_s++;
 		if (kbd->layer_state[idx].active())
 			kbd->layer_state[idx].activation_time = ts;
+		sync_layer(kbd, idx);
 	} else {
 		for (uint16_t i : layer) {
 			dbg("Activating layer %s", kbd->config.layers[i].name.c_str());
@@ -383,6 +456,7 @@ static void activate_layer(struct keyboard *kbd, uint16_t code, int idx)
 			state.active_s++;
 			if (state.active())
 				state.activation_time = ts;
+			sync_layer(kbd, i);
 		}
 	}
 
@@ -392,53 +466,20 @@ static void activate_layer(struct keyboard *kbd, uint16_t code, int idx)
 	kbd->output.on_layer_change(kbd, &layer, 1);
 }
 
-/* Returns:
- *  0 on no match
- *  1 on partial match
- *  2 on exact match
- */
-static int chord_event_match(struct chord *chord, struct key_event *events, size_t nevents)
-{
-	size_t i, j;
-	size_t n = 0;
-	size_t npressed = 0;
-
-	if (!nevents)
-		return 0;
-
-	for (i = 0; i < nevents; i++)
-		if (events[i].pressed) {
-			int found = 0;
-
-			npressed++;
-			for (j = 0; j < chord->keys.size(); j++)
-				if (chord->keys[j] == events[i].code)
-					found = 1;
-
-			if (!found)
-				return 0;
-			else
-				n++;
-		}
-
-	if (npressed == 0)
-		return 0;
-	else
-		return n == (chord->keys.size() - std::count(chord->keys.begin(), chord->keys.end(), 0)) ? 2 : 1;
-}
-
 static void enqueue_chord_event(struct keyboard *kbd, uint16_t code, uint8_t pressed, int64_t time)
 {
 	if (!code)
 		return;
 
-	assert(kbd->chord.queue_sz < ARRAY_SIZE(kbd->chord.queue));
-
-	kbd->chord.queue[kbd->chord.queue_sz].code = code;
-	kbd->chord.queue[kbd->chord.queue_sz].pressed = pressed;
-	kbd->chord.queue[kbd->chord.queue_sz].timestamp = time;
+	auto& ev = kbd->chord.queue.emplace_back();
+	ev.code = code;
+	ev.pressed = pressed;
+	ev.timestamp = time;
 
-	kbd->chord.queue_sz++;
+	if (pressed) {
+		auto& keys = kbd->chord.pressed;
+		keys.insert(std::upper_bound(keys.begin(), keys.end(), code), code);
+	}
 }
 
 /* Returns:
@@ -453,33 +494,43 @@ static int check_chord_match(struct keyboard *kbd, const struct chord **chord, i
 	int full_match = 0;
 	int partial_match = 0;
 	int64_t maxts = -1;
+	size_t maxidx = 0;
+
+	const auto& keys = kbd->chord.pressed;
+	if (keys.empty())
+		return 0;
 
-	for (idx = 0; idx < kbd->config.layers.size(); idx++) {
+	// Ties go to the higher layer index
+	auto match_layer = [&](size_t idx) {
 		struct layer *layer = &kbd->config.layers[idx];
+		const int64_t ts = kbd->layer_state[idx].activation_time;
 
-		if (!kbd->layer_state[idx].composite && !kbd->layer_state[idx].active())
-			continue;
-		if (kbd->layer_state[idx].composite) {
-			if (std::any_of(layer->begin(), layer->end(), [&](auto i) { return !kbd->layer_state[i].active(); }))
-				continue;
+		if (layer->chords.empty())
+			return;
+
+		const int i = layer->find_chord(keys.data(), keys.size());
+		if (i >= 0 && (maxts < ts || (maxts == ts && maxidx <= idx))) {
+			*chord_layer = (int)idx;
+			*chord = &layer->chords[i];
+
+			full_match = 1;
+			maxts = ts;
+			maxidx = idx;
 		}
+		if (!partial_match && layer->chord_partial(keys.data(), keys.size()))
+			partial_match = 1;
+	};
 
-		for (size_t i = 0; i < layer->chords.size(); i++) {
-			int ret = chord_event_match(&layer->chords[i],
-						    kbd->chord.queue,
-						    kbd->chord.queue_sz);
+	for (uint16_t idx : kbd->active_layers) {
+		if (!kbd->layer_state[idx].composite)
+			match_layer(idx);
+	}
 
-			if (ret == 2 &&
-				maxts <= int64_t(kbd->layer_state[idx].activation_time)) {
-				*chord_layer = (int)idx;
-				*chord = &layer->chords[i];
+	for (size_t c = 0; c < kbd->config.composites.size(); c++) {
+		idx = kbd->config.composites[c];
 
-				full_match = 1;
-				maxts = kbd->layer_state[idx].activation_time;
-			} else if (ret == 1) {
-				partial_match = 1;
-			}
-		}
+		if (kbd->layer_state[idx].composite && composite_active(kbd, c))
+			match_layer(idx);
 	}
 
 	if (full_match)
@@ -568,10 +619,12 @@ static void setlayout(struct keyboard *kbd, int idx)
 	if (kbd->layout) {
 		// TODO: this may not actually work as expected
 		kbd->layer_state[kbd->layout].active_s--;
+		sync_layer(kbd, kbd->layout);
 	}
 	if (idx) {
 		kbd->layer_state[idx].active_s++;
 		kbd->layer_state[idx].activation_time = 1;
+		sync_layer(kbd, idx);
 	}
 	kbd->layout = idx;
 	kbd->output.on_layer_change(kbd, &kbd->config.layers[idx], 1);
@@ -580,26 +633,21 @@ static void setlayout(struct keyboard *kbd, int idx)
 
 static void schedule_timeout(struct keyboard *kbd, int64_t timeout)
 {
-	assert(kbd->nr_timeouts < ARRAY_SIZE(kbd->timeouts));
-	kbd->timeouts[kbd->nr_timeouts++] = timeout;
+	kbd->timeouts.push_back(timeout);
+	std::push_heap(kbd->timeouts.begin(), kbd->timeouts.end(), std::greater<>());
 }
 
 static int64_t calculate_main_loop_timeout(struct keyboard *kbd, int64_t time)
 {
-	size_t i;
-	int64_t timeout = 0;
-	size_t n = 0;
-
-	for (i = 0; i < kbd->nr_timeouts; i++)
-		if (kbd->timeouts[i] > time) {
-			if (!timeout || kbd->timeouts[i] < timeout)
-				timeout = kbd->timeouts[i];
+	auto& heap = kbd->timeouts;
 
-			kbd->timeouts[n++] = kbd->timeouts[i];
-		}
+	// Drop expired deadlines
+	while (!heap.empty() && heap.front() <= time) {
+		std::pop_heap(heap.begin(), heap.end(), std::greater<>());
+		heap.pop_back();
+	}
 
-	kbd->nr_timeouts = n;
-	return timeout ? timeout - time : 0;
+	return heap.empty() ? 0 : heap.front() - time;
 }
 
 static void do_keysequence(struct keyboard *kbd, int16_t dl, int pressed, int64_t time, uint16_t code, uint8_t mods, uint8_t wildcard)
@@ -646,7 +694,7 @@ static int64_t process_descriptor(struct keyboard *kbd, uint16_t code, const str
 			do_keysequence(kbd, dl, pressed, time, new_code, macro[0].mods.mods, macro[0].mods.wildc);
 		} else if (pressed) {
 			// Proceed normally
-			execute_macro(kbd, dl, macro_code, code);
+			execute_macro(kbd, dl, macro_code, code, time);
 		}
 		break;
 	}
@@ -690,7 +738,7 @@ static int64_t process_descriptor(struct keyboard *kbd, uint16_t code, const str
 		break;
 	case OP_OVERLOAD_IDLE_TIMEOUT:
 		if (pressed) {
-			int64_t timeout = d->args[2].timeout;
+			int64_t timeout = ms_to_us(d->args[2].timeout);
 
 			if (((time - kbd->last_simple_key_time) >= timeout))
 				action = &kbd->config.descriptors[d->args[1].idx];
@@ -698,12 +746,8 @@ static int64_t process_descriptor(struct keyboard *kbd, uint16_t code, const str
 				action = &kbd->config.descriptors[d->args[0].idx];
 
 			process_descriptor(kbd, code, action, dl, 1, time);
-			for (int i = 0; i < CACHE_SIZE; i++) {
-				if (code == kbd->cache[i].code) {
-					kbd->cache[i].d = *action;
-					break;
-				}
-			}
+			if (struct cache_entry *ce = cache_get(kbd, code))
+				ce->d = *action;
 		}
 		break;
 	case OP_OVERLOAD_TIMEOUT_TAP:
@@ -721,7 +765,7 @@ static int64_t process_descriptor(struct keyboard *kbd, uint16_t code, const str
 			kbd->pending_key.action1 = kbd->config.descriptors[d->args[1].idx];
 			kbd->pending_key.action2.op = OP_LAYER;
 			kbd->pending_key.action2.args[0].idx = layer;
-			kbd->pending_key.expire = time + d->args[2].timeout;
+			kbd->pending_key.expire = time + ms_to_us(d->args[2].timeout);
 
 			schedule_timeout(kbd, kbd->pending_key.expire);
 		}
@@ -785,13 +829,13 @@ static int64_t process_descriptor(struct keyboard *kbd, uint16_t code, const str
 
 			if (kbd->last_pressed_code == code &&
 			    (!kbd->config.overload_tap_timeout ||
-			     ((time - kbd->overload_start_time) < kbd->config.overload_tap_timeout))) {
+			     ((time - kbd->overload_start_time) < ms_to_us(kbd->config.overload_tap_timeout)))) {
 				if (action->op == OP_MACRO) {
 					/*
 					 * Macro release relies on event logic, so we can't just synthesize a
 					 * descriptor release.
 					 */
-					execute_macro(kbd, dl, action->args[0].code, code);
+					execute_macro(kbd, dl, action->args[0].code, code, time);
 				} else {
 					process_descriptor(kbd, code, action, dl, 1, time);
 					process_descriptor(kbd, code, action, dl, 0, time);
@@ -816,7 +860,7 @@ static int64_t process_descriptor(struct keyboard *kbd, uint16_t code, const str
 			if (kbd->oneshot_latch) {
 				kbd->layer_state[idx].oneshot_depth++;
 				if (kbd->config.oneshot_timeout) {
-					kbd->oneshot_timeout = time + kbd->config.oneshot_timeout;
+					kbd->oneshot_timeout = time + ms_to_us(kbd->config.oneshot_timeout);
 					schedule_timeout(kbd, kbd->oneshot_timeout);
 				}
 			} else {
@@ -833,23 +877,24 @@ static int64_t process_descriptor(struct keyboard *kbd, uint16_t code, const str
 			if (d->op == OP_MACRO2) {
 				macro_idx = d->args[2].code;
 
-				timeout = d->args[0].timeout;
-				kbd->macro_repeat_interval = d->args[1].timeout;
+				timeout = ms_to_us(d->args[0].timeout);
+				kbd->macro_repeat_interval = ms_to_us(d->args[1].timeout);
 			} else {
 				macro_idx = d->args[0].code;
 
-				timeout = kbd->config.macro_timeout;
-				kbd->macro_repeat_interval = kbd->config.macro_repeat_timeout;
+				timeout = ms_to_us(kbd->config.macro_timeout);
+				kbd->macro_repeat_interval = ms_to_us(kbd->config.macro_repeat_timeout);
 			}
 
 			clear_oneshot(kbd, "macro");
 
-			timeout += execute_macro(kbd, dl, macro_idx, code);
 			kbd->active_macro = macro_idx;
 			kbd->active_macro_layer = dl;
 
 			kbd->macro_timeout = time + timeout;
 			schedule_timeout(kbd, kbd->macro_timeout);
+
+			execute_macro(kbd, dl, macro_idx, code, time);
 		}
 
 		break;
@@ -884,7 +929,7 @@ static int64_t process_descriptor(struct keyboard *kbd, uint16_t code, const str
 
 			kbd->pending_key.code = code;
 			kbd->pending_key.dl = dl;
-			kbd->pending_key.expire = time + d->args[1].timeout;
+			kbd->pending_key.expire = time + ms_to_us(d->args[1].timeout);
 			kbd->pending_key.behaviour = PK_INTERRUPT_ACTION1;
 
 			schedule_timeout(kbd, kbd->pending_key.expire);
@@ -900,7 +945,6 @@ static int64_t process_descriptor(struct keyboard *kbd, uint16_t code, const str
 			idx = auto_layer();
 
 		if (pressed) {
-			size_t i;
 			struct cache_entry *ce = NULL;
 
 			if (kbd->layer_state[dl].toggled) {
@@ -918,12 +962,11 @@ static int64_t process_descriptor(struct keyboard *kbd, uint16_t code, const str
 				kbd->layer_state[idx].oneshot_depth++;
 				update_mods(kbd, -1, 0);
 			} else {
-				for (i = 0; i < CACHE_SIZE; i++) {
-					uint16_t code = kbd->cache[i].code;
-					int16_t layer = kbd->cache[i].layer;
+				for (auto& held : kbd->cache) {
+					int16_t layer = held.layer;
 
-					if (code && layer == dl && layer != kbd->layout && layer != 0) {
-						ce = &kbd->cache[i];
+					if (layer == dl && layer != kbd->layout && layer != 0) {
+						ce = &held;
 						break;
 					}
 				}
@@ -940,7 +983,7 @@ static int64_t process_descriptor(struct keyboard *kbd, uint16_t code, const str
 			}
 
 			if (d->op == OP_SWAPM)
-				execute_macro(kbd, dl, d->args[1].code, code);
+				execute_macro(kbd, dl, d->args[1].code, code, time);
 		} else if (d->op == OP_SWAPM) {
 			auto& macro = kbd->config.macros[d->args[1].code & INT16_MAX];
 			if (macro.size == 1 && macro[0].type <= MACRO_KEY_TAP) {
@@ -969,6 +1012,7 @@ std::unique_ptr<keyboard> new_keyboard(std::unique_ptr<keyboard> kbd)
 	kbd->update_layer_state();
 	kbd->layer_state[0].active_s = 1;
 	kbd->layer_state[0].activation_time = 0;
+	sync_layer(kbd.get(), 0);
 
 	if (kbd->config.default_layout && kbd->config.default_layout != kbd->config.layers[0].name) {
 		int found = 0;
@@ -978,6 +1022,7 @@ std::unique_ptr<keyboard> new_keyboard(std::unique_ptr<keyboard> kbd)
 			if (layer->name == kbd->config.default_layout) {
 				kbd->layer_state[i].active_s = 1;
 				kbd->layer_state[i].activation_time = 1;
+				sync_layer(kbd.get(), i);
 				kbd->layout = i;
 				found = 1;
 				break;
@@ -989,7 +1034,10 @@ std::unique_ptr<keyboard> new_keyboard(std::unique_ptr<keyboard> kbd)
 				kbd->config.default_layout.c_str());
 	}
 
-	kbd->chord.queue_sz = 0;
+	kbd->cache.reserve(MAX_ACTIVE_KEYS);
+
+	kbd->chord.queue.reserve(32);
+	kbd->chord.pressed.reserve(32);
 	kbd->chord.state = CHORD_INACTIVE;
 
 	return kbd;
@@ -1006,11 +1054,12 @@ static int resolve_chord(struct keyboard *kbd)
 		size_t i;
 		uint16_t code = 0;
 
-		for (i = 0; i < ARRAY_SIZE(kbd->active_chords); i++) {
+		for (i = 0; i < kbd->config.chord_max_active; i++) {
 			struct active_chord *ac = &kbd->active_chords[i];
 			if (!ac->active) {
 				ac->active = 1;
 				ac->chord = *chord;
+				ac->held.assign(chord->keys.begin(), chord->keys.end());
 				ac->layer = kbd->chord.match_layer;
 				code = KEYD_CHORD_1 + i;
 
@@ -1018,16 +1067,17 @@ static int resolve_chord(struct keyboard *kbd)
 			}
 		}
 
-		assert(code);
-
-		queue_offset = chord->keys.size() - std::count(chord->keys.begin(), chord->keys.end(), 0);
-		process_event(kbd, code, 1, kbd->chord.last_code_time);
+		// Without a free slot the keys are processed individually
+		if (code) {
+			queue_offset = chord->keys.size();
+			process_event(kbd, code, 1, kbd->chord.last_code_time);
+		}
 	}
 
 
 	kbd_process_events(kbd,
-			   kbd->chord.queue + queue_offset,
-			   kbd->chord.queue_sz - queue_offset);
+			   kbd->chord.queue.data() + queue_offset,
+			   kbd->chord.queue.size() - queue_offset);
 	kbd->chord.state = CHORD_INACTIVE;
 	return 1;
 }
@@ -1041,30 +1091,17 @@ static int abort_chord(struct keyboard *kbd)
 static int handle_chord(struct keyboard *kbd, uint16_t code, int pressed, int64_t time)
 {
 	size_t i;
-	const int64_t interkey_timeout = kbd->config.chord_interkey_timeout;
-	const int64_t hold_timeout = kbd->config.chord_hold_timeout;
+	const int64_t interkey_timeout = ms_to_us(kbd->config.chord_interkey_timeout);
+	const int64_t hold_timeout = ms_to_us(kbd->config.chord_hold_timeout);
 
 	if (code && !pressed) {
-		for (i = 0; i < ARRAY_SIZE(kbd->active_chords); i++) {
+		for (i = 0; i < kbd->config.chord_max_active; i++) {
 			struct active_chord *ac = &kbd->active_chords[i];
-			uint8_t chord_code = KEYD_CHORD_1 + i;
+			uint16_t chord_code = KEYD_CHORD_1 + i;
 
 			if (ac->active) {
-				int nremaining = 0;
-				int found = 0;
-
-				for (size_t i = 0; i < ac->chord.keys.size(); i++) {
-					if (ac->chord.keys[i] == code) {
-						ac->chord.keys[i] = 0;
-						found = 1;
-					}
-
-					if (ac->chord.keys[i])
-						nremaining++;
-				}
-
-				if (found) {
-					if (nremaining == 0) {
+				if (std::erase(ac->held, code)) {
+					if (ac->held.empty()) {
 						ac->active = 0;
 						process_event(kbd, chord_code, 0, time);
 					}
@@ -1079,7 +1116,8 @@ static int handle_chord(struct keyboard *kbd, uint16_t code, int pressed, int64_
 	case CHORD_RESOLVING:
 		return 0;
 	case CHORD_INACTIVE:
-		kbd->chord.queue_sz = 0;
+		kbd->chord.queue.clear();
+		kbd->chord.pressed.clear();
 		kbd->chord.match = NULL;
 		kbd->chord.start_code = code;
 
@@ -1271,10 +1309,57 @@ int handle_pending_key(struct keyboard *kbd, uint16_t code, int pressed, int64_t
  * of process_event must take place. A return value of 0 permits the
  * main loop to call at liberty.
  */
+/*
+ * Advance the macro being played back. Input arriving in the meantime is
+ * queued (or completes the macro without delays once the queue is full) and
+ * processed after the macro. Returns false while the event is deferred.
+ */
+static bool resume_macro(struct keyboard *kbd, uint16_t code, int pressed, int64_t time)
+{
+	auto& pb = kbd->playback;
+
+	if (pb.cursor.active()) {
+		if (code && pb.queue_sz < ARRAY_SIZE(pb.queue)) {
+			pb.queue[pb.queue_sz].code = code;
+			pb.queue[pb.queue_sz].pressed = pressed;
+			pb.queue[pb.queue_sz].timestamp = time;
+			pb.queue_sz++;
+			return false;
+		}
+
+		if (code)
+			macro_finish(pb.cursor);
+		else if (time >= pb.resume)
+			play_macro(kbd, time);
+
+		if (pb.cursor.active())
+			return false;
+	}
+
+	if (pb.queue_sz) {
+		struct key_event queue[ARRAY_SIZE(pb.queue)];
+		size_t queue_sz = pb.queue_sz;
+
+		memcpy(queue, pb.queue, sizeof pb.queue);
+		pb.queue_sz = 0;
+
+		kbd_process_events(kbd, queue, queue_sz);
+
+		// The deferred input may have started another macro
+		if (pb.cursor.active())
+			return resume_macro(kbd, code, pressed, time);
+	}
+
+	return true;
+}
+
 static int64_t process_event(struct keyboard *kbd, uint16_t code, int pressed, int64_t time)
 {
 	int dl = -1;
 
+	if (!resume_macro(kbd, code, pressed, time))
+		goto exit;
+
 	if (handle_chord(kbd, code, pressed, time))
 		goto exit;
 
@@ -1291,9 +1376,9 @@ static int64_t process_event(struct keyboard *kbd, uint16_t code, int pressed, i
 			kbd->active_macro = -1;
 			update_mods(kbd, -1, 0);
 		} else if (time >= kbd->macro_timeout) {
-			auto add = execute_macro(kbd, kbd->active_macro_layer, kbd->active_macro, code);
-			kbd->macro_timeout = add + time + kbd->macro_repeat_interval;
+			kbd->macro_timeout = time + kbd->macro_repeat_interval;
 			schedule_timeout(kbd, kbd->macro_timeout);
+			execute_macro(kbd, kbd->active_macro_layer, kbd->active_macro, code, time);
 		}
 	}
 
@@ -1319,17 +1404,16 @@ static int64_t process_event(struct keyboard *kbd, uint16_t code, int pressed, i
 				.dl = dl,
 				.layer = 0,
 			};
-			if (cache_set(kbd, code, &ce))
-				goto exit;
+			cache_set(kbd, code, &ce);
 		} else {
 			struct cache_entry *ce;
 			if (!(ce = cache_get(kbd, code)))
 				goto exit;
 
-			cache_set(kbd, code, NULL);
-
 			d = ce->d;
 			dl = ce->dl;
+
+			cache_del(kbd, code);
 		}
 
 		process_descriptor(kbd, code, &d, dl, pressed, time);
@@ -1368,8 +1452,24 @@ int64_t kbd_process_events(struct keyboard *kbd, const struct key_event *events,
 	return timeout;
 }
 
+/*
+ * Return true if no state is pending which a key press would resolve
+ * (overloads, chords, deferred input, oneshots and any layer above main and
+ * the layout).
+ */
+bool kbd_is_idle(const struct keyboard *kbd)
+{
+	return !kbd->pending_key.code && kbd->chord.state == CHORD_INACTIVE &&
+	       !kbd->playback.cursor.active() &&
+	       kbd->active_layers.size() == 1 + (kbd->layout != 0);
+}
+
 bool kbd_eval(struct keyboard* kbd, std::string_view exp)
 {
+	// The macro being played back may be modified
+	macro_finish(kbd->playback.cursor);
+	kbd->config_gen++;
+
 	if (exp.empty())
 		return true;
 	if (exp == "reset") {
@@ -1381,6 +1481,7 @@ bool kbd_eval(struct keyboard* kbd, std::string_view exp)
 		// TODO: execute clear? Or it's OK?
 		for (auto& layer : kbd->config.layers) {
 			layer.chords.clear();
+			layer.chord_trie.clear();
 			layer.keymap.mapv.clear();
 		}
 		return true;
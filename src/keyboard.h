@@ -13,9 +13,10 @@
 #include "device.h"
 #include <memory>
 #include <bitset>
+#include <array>
+#include <vector>
 
 #define MAX_ACTIVE_KEYS	32
-#define CACHE_SIZE	16 //Effectively nkro
 
 struct keyboard;
 
@@ -29,12 +30,15 @@ struct cache_entry {
 struct key_event {
 	uint16_t code : 10;
 	uint16_t pressed : 1;
-	int timestamp;
+	int64_t timestamp; /* CLOCK_MONOTONIC, in microseconds */
 };
 
 struct output {
 	void (*send_key) (uint16_t code, uint8_t state);
 	void (*on_layer_change) (const struct keyboard *kbd, struct layer *layer, uint8_t active);
+
+	// Owned by the caller (the daemon's output device)
+	void *data = nullptr;
 };
 
 enum class chord_state_e : signed char {
@@ -59,6 +63,9 @@ struct active_chord {
 	uint8_t active;
 	struct chord chord;
 	int layer;
+
+	// Keys of the chord which are still held
+	std::vector<uint16_t> held;
 };
 
 /* May correspond to more than one physical input device. */
@@ -70,8 +77,11 @@ struct keyboard {
 	/*
 	 * Cache descriptors to preserve code->descriptor
 	 * mappings in the event of mid-stroke layer changes.
+	 * Holds one entry per held key (unordered), cache_idx
+	 * maps a code to its position + 1 (0 if not held).
 	 */
-	struct cache_entry cache[CACHE_SIZE];
+	std::vector<cache_entry> cache;
+	std::array<uint16_t, KEYD_ENTRY_COUNT> cache_idx{};
 
 	int16_t layout = 0;
 
@@ -95,14 +105,30 @@ struct keyboard {
 
 	int64_t last_simple_key_time;
 
-	int64_t timeouts[64];
-	size_t nr_timeouts;
+	/*
+	 * Macro being played back. Input received in the meantime is deferred
+	 * and processed in order once it completes.
+	 */
+	struct {
+		struct macro_cursor cursor;
+		int64_t resume;
+
+		struct key_event queue[32];
+		size_t queue_sz;
+	} playback;
+
+	// Pending deadlines (min-heap)
+	std::vector<int64_t> timeouts;
+
+	// Deadline queued in the main loop (not used by the engine)
+	int64_t deadline = 0;
 
 	struct active_chord active_chords[KEYD_CHORD_MAX-KEYD_CHORD_1+1];
 
 	struct {
-		struct key_event queue[32];
-		size_t queue_sz;
+		std::vector<key_event> queue;
+		// Codes of the queued presses, sorted
+		std::vector<uint16_t> pressed;
 
 		const struct chord *match;
 		int match_layer;
@@ -142,12 +168,62 @@ struct keyboard {
 	};
 	static_assert(sizeof(layer_state_t) == 8);
 	std::vector<layer_state_t> layer_state;
-	std::vector<uint16_t> active_layers; // Currently not updated, just a buffer
+
+	/*
+	 * Active layers (including main) ordered by activation_time, oldest
+	 * first, and the same set as a bitset. Kept in sync with layer_state.
+	 */
+	std::vector<uint16_t> active_layers;
+	std::vector<uint64_t> active_mask;
+
+	bool layer_active(size_t idx) const
+	{
+		return active_mask[idx / 64] >> (idx % 64) & 1;
+	}
+
+	/*
+	 * Memoized descriptor lookups, direct mapped on (code, mods, layers).
+	 * layer_tag hashes the active layer stack in activation order, so
+	 * entries survive layer changes and are only dropped when config_gen
+	 * is bumped by a config change.
+	 */
+	struct lookup_entry {
+		uint64_t tag;
+		uint32_t gen;
+		uint16_t code;
+		uint8_t mods;
+		int16_t dl;
+		struct descriptor d;
+	};
+	std::array<lookup_entry, 512> lookup_cache{};
+	uint64_t layer_tag = 0;
+	uint32_t config_gen = 1;
+
+	void update_layer_tag()
+	{
+		// FNV-1a over the stack, marking layers activated together with the previous one
+		uint64_t h = 0xcbf29ce484222325;
+		for (size_t j = 0; j < active_layers.size(); j++) {
+			const uint16_t i = active_layers[j];
+			const bool tie = j && layer_state[i].activation_time == layer_state[active_layers[j - 1]].activation_time;
+			h = (h ^ (i | tie << 16)) * 0x100000001b3;
+		}
+		layer_tag = h;
+	}
 
 	void update_layer_state()
 	{
+		config_gen++;
 		layer_state.resize(config.layers.size());
-		active_layers.resize(config.layers.size());
+
+		// Layers may have been dropped by a reset
+		std::erase_if(active_layers, [&](uint16_t i) { return i >= layer_state.size(); });
+		active_layers.reserve(layer_state.size());
+		active_mask.assign((layer_state.size() + 63) / 64, 0);
+		for (uint16_t i : active_layers)
+			active_mask[i / 64] |= uint64_t(1) << (i % 64);
+		update_layer_tag();
+
 		for (size_t i = 0; i < layer_state.size(); i++) {
 			auto& layer = config.layers[i];
 			// Cache whether the layer is truly composite (not dummy)
@@ -165,11 +241,16 @@ struct keyboard {
 		int sensitivity; /* Mouse units per scroll unit (higher == slower scrolling). */
 		int active;
 	} scroll;
+
+	/* Wheel input short of a detent, in 1/WHEEL_DETENT units. */
+	int wheel_x;
+	int wheel_y;
 };
 
 std::unique_ptr<keyboard> new_keyboard(std::unique_ptr<keyboard>);
 
 int64_t kbd_process_events(struct keyboard *kbd, const struct key_event *events, size_t n, bool real = false);
+bool kbd_is_idle(const struct keyboard *kbd);
 bool kbd_eval(struct keyboard *kbd, std::string_view);
 void kbd_reset(struct keyboard *kbd);
 
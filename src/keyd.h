@@ -67,9 +67,11 @@ using enum event_type;
 struct event {
 	enum event_type type;
 	int fd;
-	int64_t timestamp;
+	int64_t timestamp; /* CLOCK_MONOTONIC, in microseconds */
 	struct device *dev;
+	/* Batch of events read from dev. */
 	struct device_event *devev;
+	size_t nr_devev;
 };
 
 enum class ipc_msg_type_e : signed char {
@@ -97,7 +99,11 @@ int monitor(int argc, char *argv[]);
 int run_daemon(int argc, char *argv[]);
 
 void evloop_add_fd(int fd);
-int evloop(int (*event_handler)(struct event* ev), bool monitor = false);
+/*
+ * The handler returns the absolute CLOCK_MONOTONIC deadline (in microseconds)
+ * at which it wants to receive EV_TIMEOUT, or 0 if none is pending.
+ */
+int evloop(int64_t (*event_handler)(struct event* ev), bool monitor = false);
 
 void xwrite(int fd, const void *buf, size_t sz);
 bool xread(int fd, void *buf, size_t sz);
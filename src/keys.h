@@ -51,14 +51,11 @@ struct modifier {
 	uint16_t key;
 };
 
-/* Deviations (TODO: use special value range)*/
-
-#define  KEYD_CHORD_1                  197
-#define  KEYD_CHORD_2                  198
-#define  KEYD_CHORD_MAX                        199
-
 // /* Special values. */
 
+#define KEYD_CHORD_1			0x310
+#define KEYD_CHORD_MAX			(KEYD_CHORD_1 + 63)
+
 #define KEYD_WHEELUP			0x300
 #define KEYD_WHEELDOWN			0x301
 #define KEYD_WHEELLEFT			0x302
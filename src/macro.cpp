@@ -45,7 +45,9 @@ static std::vector<::ucmd> cmd_buf;
 
 int macro_parse(std::string_view s, macro& macro, struct config* config, const smart_ptr<env_pack>& cmd_env)
 {
-	cmd_buf.clear();
+	// Commands of an IPC macro stay valid until the next one is parsed
+	if (!config)
+		cmd_buf.clear();
 
 	auto& commands = config ? config->commands : cmd_buf;
 
@@ -222,38 +224,84 @@ int macro_parse(std::string_view s, macro& macro, struct config* config, const s
 	return 0;
 }
 
-uint64_t macro_execute(void (*output)(uint16_t, uint8_t), const macro& macro, uint64_t timeout, struct config* config)
+static uint16_t mod_code(const struct config *config, size_t idx)
 {
-	uint64_t t = 0;
-	int hold_start = -1;
+	static constexpr std::array<uint16_t, MAX_MOD> def_mods{
+		KEY_LEFTALT,
+		KEY_LEFTMETA,
+		KEY_LEFTSHIFT,
+		KEY_LEFTCTRL,
+		KEY_RIGHTALT,
+	};
+
+	if (!config)
+		return def_mods[idx];
+
+	return config->modifiers[idx] ? config->modifiers[idx][0] : 0;
+}
+
+static void output_mods(const macro_cursor& c, uint8_t mods, uint8_t pressed)
+{
+	for (size_t j = 0; j < MAX_MOD; j++) {
+		uint16_t code = mod_code(c.config, j);
+
+		if (mods & (1 << j) && code)
+			c.output(code, pressed);
+	}
+}
+
+void macro_start(macro_cursor& c, void (*output)(uint16_t, uint8_t), const macro& macro, uint64_t timeout, struct config* config)
+{
+	c.macro = &macro;
+	c.config = config;
+	c.output = output;
+	c.timeout = timeout;
+	c.idx = 0;
+	c.hold_start = -1;
+	c.phase = 0;
+}
+
+int64_t macro_step(macro_cursor& c)
+{
+	while (c.active()) {
+		if (c.idx == c.macro->size) {
+			c.macro = nullptr;
+			break;
+		}
 
-	for (size_t i = 0; i < macro.size; i++) {
-		const macro_entry *ent = &macro[i];
+		const macro_entry *ent = &(*c.macro)[c.idx];
+
+		if (c.phase == 2) {
+			// Entry done, apply the sequence timeout
+			c.phase = 0;
+			c.idx++;
+
+			if (c.timeout)
+				return c.timeout;
+			continue;
+		}
 
 		switch (ent->type) {
 			size_t j;
 			uint16_t idx;
 			uint8_t codes[4];
-			uint16_t code;
-			uint8_t mods;
 
 		case MACRO_HOLD:
-			if (hold_start == -1)
-				hold_start = i;
+			if (c.hold_start == -1)
+				c.hold_start = c.idx;
 
-			output(ent->id, 1);
+			c.output(ent->id, 1);
 
 			break;
 		case MACRO_RELEASE:
-			if (hold_start != -1) {
-				size_t j;
-
-				for (j = hold_start; j < i; j++) {
-					const struct macro_entry *ent = &macro[j];
-					output(ent->id, 0);
+			if (c.hold_start != -1) {
+				for (j = c.hold_start; j < c.idx; j++) {
+					const struct macro_entry *ent = &(*c.macro)[j];
+					if (ent->type == MACRO_HOLD)
+						c.output(ent->id, 0);
 				}
 
-				hold_start = -1;
+				c.hold_start = -1;
 			}
 			break;
 		case MACRO_UNICODE:
@@ -262,64 +310,51 @@ uint64_t macro_execute(void (*output)(uint16_t, uint8_t), const macro& macro, ui
 			unicode_get_sequence(idx, codes);
 
 			for (j = 0; j < 4; j++) {
-				output(codes[j], 1);
-				output(codes[j], 0);
+				c.output(codes[j], 1);
+				c.output(codes[j], 0);
 			}
 
 			break;
 		case MACRO_KEY_SEQ:
 		case MACRO_KEY_TAP:
-			code = ent->id;
-			mods = ent->mods.mods;
-
-			static constexpr std::array<uint16_t, MAX_MOD> def_mods{
-				KEY_LEFTALT,
-				KEY_LEFTMETA,
-				KEY_LEFTSHIFT,
-				KEY_LEFTCTRL,
-				KEY_RIGHTALT,
-			};
-
-			for (j = 0; j < MAX_MOD; j++) {
-				uint16_t code = (config ? (config->modifiers[j] ? config->modifiers[j][0] : 0) : def_mods[j]);
-				uint8_t mask = 1 << j;
-
-				if (mods & mask && code)
-					output(code, 1);
-			}
-
-			if (mods && timeout)
-				t += timeout, usleep(timeout);
-
-			output(code, 1);
-			output(code, 0);
+			if (c.phase == 0) {
+				output_mods(c, ent->mods.mods, 1);
 
-			for (j = 0; j < MAX_MOD; j++) {
-				uint16_t code = (config ? (config->modifiers[j] ? config->modifiers[j][0] : 0) : def_mods[j]);
-				uint8_t mask = 1 << j;
-
-				if (mods & mask && code)
-					output(code, 0);
+				c.phase = 1;
+				if (ent->mods.mods && c.timeout)
+					return c.timeout;
 			}
 
+			c.output(ent->id, 1);
+			c.output(ent->id, 0);
+
+			output_mods(c, ent->mods.mods, 0);
 
 			break;
 		case MACRO_TIMEOUT:
-			t += ent->code * 1000;
-			usleep(ent->code * 1000);
+			if (c.phase == 0) {
+				c.phase = 1;
+				if (ent->code)
+					return ent->code * 1000;
+			}
 			break;
 		case MACRO_COMMAND:
 			extern void execute_command(ucmd& cmd);
-			execute_command(config ? config->commands.at(ent->code) : cmd_buf.at(ent->code));
+			execute_command(c.config ? c.config->commands.at(ent->code) : cmd_buf.at(ent->code));
 			break;
 		default:
+			c.idx++;
 			continue;
 		}
 
-		if (timeout)
-			t += timeout, usleep(timeout);
+		c.phase = 2;
 	}
 
-	cmd_buf.clear();
-	return t;
+	return 0;
+}
+
+void macro_finish(macro_cursor& c)
+{
+	while (c.active())
+		macro_step(c);
 }
@@ -55,7 +55,35 @@ struct macro {
 	bool equals(const struct config*, const macro&) const;
 };
 
-uint64_t macro_execute(void (*output)(uint16_t, uint8_t), const macro& macro, uint64_t timeout, struct config* config);
+/*
+ * Playback state of a macro. Delays are returned to the caller instead of
+ * sleeping, so the event loop keeps running while a macro plays.
+ */
+struct macro_cursor {
+	const struct macro *macro = nullptr;
+	struct config *config = nullptr;
+	void (*output)(uint16_t, uint8_t) = nullptr;
+	uint64_t timeout = 0; /* Delay between entries (us) */
+	uint32_t idx = 0;
+	int32_t hold_start = -1;
+	uint8_t phase = 0;
+
+	bool active() const
+	{
+		return macro != nullptr;
+	}
+};
+
+void macro_start(macro_cursor& c, void (*output)(uint16_t, uint8_t), const macro& macro, uint64_t timeout, struct config* config);
+
+/*
+ * Play the macro up to the next delay. Returns the delay in microseconds, or
+ * 0 once the macro has completed.
+ */
+int64_t macro_step(macro_cursor& c);
+
+/* Play the rest of the macro without delays. */
+void macro_finish(macro_cursor& c);
 
 int macro_parse(std::string_view, macro& macro, struct config* config, const smart_ptr<struct env_pack>&);
 #endif
@@ -31,7 +31,7 @@ static void cleanup()
 	set_tflags(ICANON|ECHO, 1);
 }
 
-int event_handler(struct event *ev)
+int64_t event_handler(struct event *ev)
 {
 	static int64_t last_time = 0;
 
@@ -45,20 +45,23 @@ int event_handler(struct event *ev)
 		keyd_log("device removed: %s %s (/dev/input/event%u)\n", ev->dev->id, ev->dev->name, ev->dev->num);
 		break;
 	case EV_DEV_EVENT:
-		switch (ev->devev->type) {
-		case DEV_KEY:
-			name = KEY_NAME(ev->devev->code);
-
-			if (time_flag && last_time)
-				keyd_log("r{+%ld} ms\t", ev->timestamp - last_time);
-
-			keyd_log("%s\t%s\t%s %s\n",
-				 ev->dev->name, ev->dev->id,
-				 name, ev->devev->pressed ? "down" : "up");
-
-			break;
-		default:
-			break;
+		for (size_t i = 0; i < ev->nr_devev; i++) {
+			switch (ev->devev[i].type) {
+			case DEV_KEY:
+				name = KEY_NAME(ev->devev[i].code);
+
+				if (time_flag && last_time)
+					keyd_log("r{+%ld} ms\t", (ev->devev[i].timestamp - last_time) / 1000);
+				last_time = ev->devev[i].timestamp;
+
+				keyd_log("%s\t%s\t%s %s\n",
+					 ev->dev->name, ev->dev->id,
+					 name, ev->devev[i].pressed ? "down" : "up");
+
+				break;
+			default:
+				break;
+			}
 		}
 		break;
 	case EV_FD_ERR:
@@ -71,7 +74,6 @@ int event_handler(struct event *ev)
 	fflush(stdout);
 	fflush(stderr);
 
-	last_time = ev->timestamp;
 	return 0;
 }
 
@@ -0,0 +1,118 @@
+/*
+ * keyd - A key remapping daemon.
+ *
+ * © 2019 Raheman Vaiya (see also: LICENSE).
+ */
+#include "keyd.h"
+#include <algorithm>
+#include <string_view>
+#include <vector>
+
+#ifndef VKBD_DEFAULT
+#define VKBD_DEFAULT "uinput"
+#endif
+
+static const struct vkbd_backend *backends[] = {
+	&uinput_backend,
+	&usb_gadget_backend,
+	&stdout_backend,
+	&trace_backend,
+};
+
+/*
+ * Every backend batches its own output until vkbd_flush(), which is then
+ * passed on to each of them in the order they were listed.
+ */
+struct vkbd {
+	struct output {
+		const struct vkbd_backend *backend;
+		void *vkbd;
+	};
+
+	std::vector<output> outputs;
+};
+
+static const struct vkbd_backend *lookup_backend(std::string_view name)
+{
+	for (auto backend : backends)
+		if (name == backend->name)
+			return backend;
+
+	return nullptr;
+}
+
+struct vkbd* vkbd_init(const char *name)
+{
+	struct vkbd *vkbd = new struct vkbd;
+	const char *list = getenv("KEYD_VKBD");
+	std::string_view s = list && *list ? list : VKBD_DEFAULT;
+
+	while (!s.empty()) {
+		std::string_view entry = s.substr(0, s.find(','));
+		s.remove_prefix(std::min(s.size(), entry.size() + 1));
+
+		if (entry.empty())
+			continue;
+
+		const struct vkbd_backend *backend = lookup_backend(entry);
+		if (!backend)
+			die("unknown output backend: %.*s", (int)entry.size(), entry.data());
+
+		vkbd->outputs.push_back({backend, backend->init(name)});
+	}
+
+	if (vkbd->outputs.empty())
+		die("no output backend selected");
+
+	return vkbd;
+}
+
+void vkbd_free(struct vkbd* vkbd)
+{
+	for (auto& out : vkbd->outputs)
+		out.backend->free(out.vkbd);
+
+	delete vkbd;
+}
+
+void vkbd_mouse_move(struct vkbd* vkbd, int x, int y)
+{
+	for (auto& out : vkbd->outputs)
+		out.backend->mouse_move(out.vkbd, x, y);
+}
+
+void vkbd_mouse_move_abs(struct vkbd* vkbd, int x, int y)
+{
+	for (auto& out : vkbd->outputs)
+		out.backend->mouse_move_abs(out.vkbd, x, y);
+}
+
+void vkbd_mouse_scroll(struct vkbd* vkbd, int x, int y)
+{
+	for (auto& out : vkbd->outputs)
+		out.backend->mouse_scroll(out.vkbd, x, y);
+}
+
+void vkbd_send_key(struct vkbd* vkbd, uint16_t code, int state)
+{
+	for (auto& out : vkbd->outputs)
+		out.backend->send_key(out.vkbd, code, state);
+}
+
+void vkbd_flush(struct vkbd* vkbd)
+{
+	for (auto& out : vkbd->outputs)
+		out.backend->flush(out.vkbd);
+}
+
+void vkbd_send_frame(struct vkbd* vkbd, int src_fd, const struct input_event *evs, size_t n)
+{
+	for (auto& out : vkbd->outputs)
+		out.backend->send_frame(out.vkbd, src_fd, evs, n);
+}
+
+void vkbd_remove_source(struct vkbd* vkbd, int src_fd)
+{
+	for (auto& out : vkbd->outputs)
+		out.backend->remove_source(out.vkbd, src_fd);
+}
@@ -6,17 +6,66 @@
 #ifndef VIRTUAL_KEYBOARD_H
 #define VIRTUAL_KEYBOARD_H
 
+#include <stddef.h>
 #include <stdint.h>
 #include <memory>
 
 struct vkbd;
+struct input_event;
 
 struct vkbd* vkbd_init(const char *name);
+/* Destroy a device which has no keys held. */
+void vkbd_free(struct vkbd* vkbd);
 
 void vkbd_mouse_move(struct vkbd* vkbd, int x, int y);
 void vkbd_mouse_move_abs(struct vkbd* vkbd, int x, int y);
+/* In 1/WHEEL_DETENT of a detent. */
 void vkbd_mouse_scroll(struct vkbd* vkbd, int x, int y);
 
 void vkbd_send_key(struct vkbd* vkbd, uint16_t code, int state);
 void vkbd_flush(struct vkbd* vkbd);
+
+/*
+ * Forward a frame of pointer events (without SYN_REPORT) verbatim, on behalf
+ * of the evdev device open as src_fd. vkbd_remove_source() must be called
+ * before that fd is closed.
+ */
+void vkbd_send_frame(struct vkbd* vkbd, int src_fd, const struct input_event *evs, size_t n);
+void vkbd_remove_source(struct vkbd* vkbd, int src_fd);
+
+/*
+ * Output backends (src/vkbd/) implement the functions above in their own
+ * namespace and export them as a vkbd_backend. The vkbd returned by
+ * vkbd_init() forwards to every backend listed in $KEYD_VKBD.
+ */
+struct vkbd_backend {
+	const char *name;
+	void* (*init)(const char *name);
+	void (*free)(void *vkbd);
+	void (*mouse_move)(void *vkbd, int x, int y);
+	void (*mouse_move_abs)(void *vkbd, int x, int y);
+	void (*mouse_scroll)(void *vkbd, int x, int y);
+	void (*send_key)(void *vkbd, uint16_t code, int state);
+	void (*flush)(void *vkbd);
+	void (*send_frame)(void *vkbd, int src_fd, const struct input_event *evs, size_t n);
+	void (*remove_source)(void *vkbd, int src_fd);
+};
+
+#define VKBD_BACKEND(NAME, NS) { \
+	NAME, \
+	[](const char *name) -> void* { return NS::vkbd_init(name); }, \
+	[](void *vkbd) { NS::vkbd_free((NS::vkbd*)vkbd); }, \
+	[](void *vkbd, int x, int y) { NS::vkbd_mouse_move((NS::vkbd*)vkbd, x, y); }, \
+	[](void *vkbd, int x, int y) { NS::vkbd_mouse_move_abs((NS::vkbd*)vkbd, x, y); }, \
+	[](void *vkbd, int x, int y) { NS::vkbd_mouse_scroll((NS::vkbd*)vkbd, x, y); }, \
+	[](void *vkbd, uint16_t code, int state) { NS::vkbd_send_key((NS::vkbd*)vkbd, code, state); }, \
+	[](void *vkbd) { NS::vkbd_flush((NS::vkbd*)vkbd); }, \
+	[](void *vkbd, int src_fd, const struct input_event *evs, size_t n) { NS::vkbd_send_frame((NS::vkbd*)vkbd, src_fd, evs, n); }, \
+	[](void *vkbd, int src_fd) { NS::vkbd_remove_source((NS::vkbd*)vkbd, src_fd); }, \
+}
+
+extern const struct vkbd_backend uinput_backend;
+extern const struct vkbd_backend usb_gadget_backend;
+extern const struct vkbd_backend stdout_backend;
+extern const struct vkbd_backend trace_backend;
 #endif
@@ -3,7 +3,7 @@
  *
  * © 2019 Raheman Vaiya (see also: LICENSE).
  */
-/* Build with make vkbd-stdout. */
+/* Select with KEYD_VKBD=stdout. */
 
 #include <stdio.h>
 #include <string.h>
@@ -14,6 +14,8 @@
 #include "../vkbd.h"
 #include "../keys.h"
 
+namespace stdout_out {
+
 struct vkbd {};
 
 struct vkbd* vkbd_init(const char*)
@@ -21,6 +23,10 @@ struct vkbd* vkbd_init(const char*)
 	return nullptr;
 }
 
+void vkbd_free(struct vkbd*)
+{
+}
+
 void vkbd_mouse_scroll(struct vkbd* vkbd, int x, int y)
 {
 	printf("mouse scroll: x: %d, y: %d\n", x, y);
@@ -44,3 +50,19 @@ void vkbd_send_key(struct vkbd* vkbd, uint16_t code, int state)
 void vkbd_flush(struct vkbd*)
 {
 }
+
+void vkbd_send_frame(struct vkbd*, int src_fd, const struct input_event *evs, size_t n)
+{
+	printf("frame from fd %d:", src_fd);
+	for (size_t i = 0; i < n; i++)
+		printf(" %d:%d:%d", evs[i].type, evs[i].code, evs[i].value);
+	printf("\n");
+}
+
+void vkbd_remove_source(struct vkbd*, int)
+{
+}
+
+}
+
+const struct vkbd_backend stdout_backend = VKBD_BACKEND("stdout", stdout_out);
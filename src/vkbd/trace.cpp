@@ -0,0 +1,187 @@
+/*
+ * keyd - A key remapping daemon.
+ *
+ * © 2019 Raheman Vaiya (see also: LICENSE).
+ */
+/* Select with KEYD_VKBD=trace. */
+
+/*
+ * Output sink for benchmarks and comparing builds. Events are appended as
+ * fixed size records to a buffer which is written to $KEYD_TRACE (required,
+ * stdout carries log output) on every vkbd_flush(), each batch terminated by
+ * an EV_SYN record.
+ * Records use evdev types and codes, with mouse motion split into REL_X/REL_Y
+ * (or ABS_X/ABS_Y) and scrolling into REL_HWHEEL_HI_RES/REL_WHEEL_HI_RES
+ * (wheel keys appear as keys). Passthrough frames are recorded as they are.
+ *
+ * With KEYD_TRACE=count nothing is written, events are only counted and the
+ * totals printed to stderr on exit.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <vector>
+
+#include "../keyd.h"
+#include "../vkbd.h"
+
+namespace trace_out {
+
+struct trace_record {
+	int64_t timestamp;
+	uint16_t type;
+	uint16_t code;
+	int32_t value;
+};
+
+static_assert(sizeof(trace_record) == 16);
+
+struct vkbd {
+	int fd = -1;
+	bool count_only = false;
+
+	// Taken once per batch, records of a batch share it
+	int64_t timestamp = 0;
+	std::vector<trace_record> buf;
+
+	uint64_t nr_events = 0;
+	uint64_t nr_batches = 0;
+
+	vkbd() = default;
+	vkbd(const vkbd&) = delete;
+	vkbd& operator=(const vkbd&) = delete;
+
+	void push(uint16_t type, uint16_t code, int32_t value)
+	{
+		if (!timestamp)
+			timestamp = get_time_us();
+
+		nr_events++;
+		if (!count_only)
+			buf.push_back({timestamp, type, code, value});
+	}
+};
+
+static struct vkbd trace;
+
+void vkbd_flush(struct vkbd* vkbd);
+
+/* Runs from exit(), which is also how SIGTERM and SIGINT stop keyd. */
+static void cleanup()
+{
+	vkbd_flush(&trace);
+
+	if (trace.count_only)
+		fprintf(stderr, "trace: %llu events in %llu batches\n",
+			(unsigned long long)trace.nr_events, (unsigned long long)trace.nr_batches);
+	else
+		close(trace.fd);
+}
+
+struct vkbd* vkbd_init(const char*)
+{
+	if (trace.fd != -1 || trace.count_only)
+		return &trace;
+
+	const char *path = getenv("KEYD_TRACE");
+
+	if (!path || !*path)
+		die("the trace backend requires KEYD_TRACE to be set");
+
+	if (!strcmp(path, "count")) {
+		trace.count_only = true;
+	} else {
+		trace.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (trace.fd < 0) {
+			perror("open");
+			exit(-1);
+		}
+	}
+
+	trace.buf.reserve(256);
+	atexit(cleanup);
+	return &trace;
+}
+
+// The trace is shared by every vkbd_init() and closed on exit
+void vkbd_free(struct vkbd*)
+{
+}
+
+void vkbd_mouse_scroll(struct vkbd* vkbd, int x, int y)
+{
+	if (x)
+		vkbd->push(EV_REL, REL_HWHEEL_HI_RES, x);
+	if (y)
+		vkbd->push(EV_REL, REL_WHEEL_HI_RES, y);
+}
+
+void vkbd_mouse_move(struct vkbd* vkbd, int x, int y)
+{
+	if (x)
+		vkbd->push(EV_REL, REL_X, x);
+	if (y)
+		vkbd->push(EV_REL, REL_Y, y);
+}
+
+void vkbd_mouse_move_abs(struct vkbd* vkbd, int x, int y)
+{
+	vkbd->push(EV_ABS, ABS_X, x);
+	vkbd->push(EV_ABS, ABS_Y, y);
+}
+
+void vkbd_send_key(struct vkbd* vkbd, uint16_t code, int state)
+{
+	vkbd->push(EV_KEY, code, state);
+}
+
+void vkbd_send_frame(struct vkbd* vkbd, int, const struct input_event *evs, size_t n)
+{
+	for (size_t i = 0; i < n; i++)
+		vkbd->push(evs[i].type, evs[i].code, evs[i].value);
+}
+
+void vkbd_remove_source(struct vkbd*, int)
+{
+}
+
+void vkbd_flush(struct vkbd* vkbd)
+{
+	if (!vkbd->timestamp)
+		return;
+
+	vkbd->nr_batches++;
+	if (vkbd->count_only) {
+		vkbd->timestamp = 0;
+		return;
+	}
+
+	vkbd->buf.push_back({vkbd->timestamp, EV_SYN, SYN_REPORT, 0});
+	vkbd->timestamp = 0;
+
+	const char *p = (const char *)vkbd->buf.data();
+	size_t left = vkbd->buf.size() * sizeof(trace_record);
+
+	while (left) {
+		ssize_t n = write(vkbd->fd, p, left);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("write trace");
+			break;
+		}
+
+		p += n;
+		left -= n;
+	}
+
+	vkbd->buf.clear();
+}
+
+}
+
+const struct vkbd_backend trace_backend = VKBD_BACKEND("trace", trace_out);
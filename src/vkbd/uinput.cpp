@@ -9,7 +9,13 @@
 #include <sys/ioctl.h>
 #include <unistd.h>
 #include <time.h>
+#include <algorithm>
+#include <bitset>
+#include <memory>
+#include <string>
 #include <utility>
+#include <vector>
+#include <errno.h>
 
 #ifdef __FreeBSD__
 	#include <dev/evdev/uinput.h>
@@ -21,15 +27,117 @@
 
 #include "../keyd.h"
 
-struct vkbd {
-	const char* name_base = "";
+namespace uinput_out {
 
+/*
+ * Events queued for a uinput device until vkbd_flush(). A frame is closed
+ * with EV_SYN before a code would change twice within it, so consumers see
+ * every transition, and all queued frames are written at once.
+ */
+struct out_queue {
 	int fd = -1;
-	int pfd = -1;
+	std::vector<struct input_event> evs;
+	// Start of the open frame
+	size_t frame = 0;
+
+	void push(uint16_t type, uint16_t code, int32_t value)
+	{
+		for (size_t i = frame; i < evs.size(); i++) {
+			if (evs[i].type == type && evs[i].code == code) {
+				sync();
+				break;
+			}
+		}
+
+		auto& ev = evs.emplace_back();
+		ev.type = type;
+		ev.code = code;
+		ev.value = value;
+	}
+
+	void sync()
+	{
+		if (frame == evs.size())
+			return;
+
+		evs.emplace_back().type = EV_SYN;
+		frame = evs.size();
+	}
+
+	void write()
+	{
+		sync();
+
+		size_t nwr = 0;
+		while (nwr != evs.size()) {
+			ssize_t n = ::write(fd, evs.data() + nwr, (evs.size() - nwr) * sizeof(evs[0]));
+			if (n < 0) {
+				if (errno == EINTR)
+					continue;
+				/*
+				 * uinput injects events synchronously and has no
+				 * queue to fill, so this does not happen in practice.
+				 * Keep the rest queued for the next flush regardless.
+				 */
+				if (errno == EAGAIN)
+					break;
+				perror("write");
+				exit(-1);
+			}
+			nwr += n / sizeof(evs[0]);
+		}
+
+		evs.erase(evs.begin(), evs.begin() + nwr);
+		frame = evs.size();
+	}
+};
+
+/*
+ * A device cloned from a passthrough source, or for merged sources (plain
+ * relative mice) the buttons they hold on the keyboard device.
+ */
+struct clone {
+	int src_fd;
+	out_queue q;
+	bool merged = false;
+	std::bitset<KEY_CNT> held;
+
+	~clone()
+	{
+		if (q.fd >= 0)
+			close(q.fd);
+	}
+};
+
+/*
+ * The keyboard device also carries buttons and relative motion, so a click
+ * can never overtake the keys preceding it. The pointer device only carries
+ * absolute motion, and buttons while the pointer is positioned absolutely.
+ * Frames of passthrough mice go to the keyboard device as well, those of
+ * sources it can't represent (touchpads, tablets, ...) to a clone of each.
+ */
+struct vkbd {
+	std::string name_base;
+
+	out_queue kbd;
+	out_queue ptr;
+
+	// Last motion was absolute
+	bool abs_active = false;
+
+	// Buttons (bit n is BTN_MOUSE + n) pressed on the pointer device
+	uint16_t ptr_buttons = 0;
 
-	// Buffered wheel events
+	// Buffered wheel events and partial detents (1/WHEEL_DETENT units)
 	int vwheel_buf = 0;
 	int hwheel_buf = 0;
+	int vwheel_part = 0;
+	int hwheel_part = 0;
+
+	std::vector<std::unique_ptr<clone>> clones;
+
+	// Queue events were last added to
+	out_queue *cur = nullptr;
 
 	vkbd(const char* name)
 		: name_base(name)
@@ -39,32 +147,87 @@ struct vkbd {
 	vkbd& operator=(const vkbd&) = delete;
 	~vkbd()
 	{
-		close(fd);
-		close(pfd);
+		close(kbd.fd);
+		close(ptr.fd);
 	}
 
-	void send_kbd_event(int fd_type, uint16_t type, uint16_t code, int32_t value)
+	/*
+	 * Every queue feeds a separate device, so switching between them writes
+	 * out what is queued for the previous one first.
+	 */
+	out_queue& use(out_queue& q)
 	{
-		struct input_event ev[2]{};
-		ev[0].type = type;
-		ev[0].code = code;
-		ev[0].value = value;
-		ev[1].type = EV_SYN;
-
-		// 0 = kbd, 1 = ptr, 2+ unimplemented
-		if (fd_type == 0)
-			xwrite(this->fd, ev, sizeof(ev));
-		else if (fd_type == 1)
-			xwrite(this->pfd, ev, sizeof(ev));
+		if (cur && cur != &q && !cur->evs.empty())
+			cur->write();
+		cur = &q;
+		return q;
+	}
+
+	out_queue& queue(bool is_ptr);
+
+	// Send both axes of a pointer frame
+	void send_ptr_frame(uint16_t type, uint16_t xcode, int32_t x, uint16_t ycode, int32_t y)
+	{
+		if (!x && !y)
+			return;
+
+		abs_active = type == EV_ABS;
+
+		out_queue& q = queue(abs_active);
+		if (x)
+			q.push(type, xcode, x);
+		if (y)
+			q.push(type, ycode, y);
+		q.sync();
 	}
 };
 
+/*
+ * Describe the device with UI_DEV_SETUP/UI_ABS_SETUP, falling back to the
+ * legacy uinput_user_dev write on kernels older than 4.5.
+ */
+static void setup_device(int fd, const char *name, const char *suffix, uint16_t product, int32_t absmax)
+{
+#ifdef UI_DEV_SETUP
+	struct uinput_setup setup = {};
+	setup.id.bustype = BUS_USB;
+	setup.id.vendor = 0x0FAC;
+	setup.id.product = product;
+	snprintf(setup.name, sizeof(setup.name), "%s%s", name, suffix);
+
+	if (!ioctl(fd, UI_DEV_SETUP, &setup)) {
+		for (int axis : {ABS_X, ABS_Y}) {
+			struct uinput_abs_setup abs = {};
+			abs.code = axis;
+			abs.absinfo.maximum = absmax;
+
+			if (absmax && ioctl(fd, UI_ABS_SETUP, &abs)) {
+				perror("ioctl abs_setup");
+				exit(-1);
+			}
+		}
+		return;
+	}
+#endif
+
+	struct uinput_user_dev udev = {};
+	udev.id.bustype = BUS_USB;
+	udev.id.vendor = 0x0FAC;
+	udev.id.product = product;
+	udev.absmax[ABS_X] = absmax;
+	udev.absmax[ABS_Y] = absmax;
+	snprintf(udev.name, sizeof(udev.name), "%s%s", name, suffix);
+
+	if (write(fd, &udev, sizeof udev) < 0) {
+		fprintf(stderr, "failed to create uinput device\n");
+		exit(-1);
+	}
+}
+
 static int create_virtual_keyboard(const char *name)
 {
 	int i;
-	int ret;
 	size_t code;
-	struct uinput_user_dev udev = {};
 
 	int fd = open("/dev/uinput", O_WRONLY | O_NONBLOCK | O_CLOEXEC);
 	if (fd < 0) {
@@ -92,12 +255,23 @@ static int create_virtual_keyboard(const char *name)
 		exit(-1);
 	}
 
-	for (code = 0; code < KEY_CNT; code++) {
-		if (true) {
-			if (ioctl(fd, UI_SET_KEYBIT, code)) {
-				perror("ioctl set_keybit");
-				exit(-1);
-			}
+	if (ioctl(fd, UI_SET_EVBIT, EV_REL)) {
+		perror("ioctl set_evbit");
+		exit(-1);
+	}
+
+	for (int rel : {REL_X, REL_Y, REL_WHEEL, REL_HWHEEL, REL_WHEEL_HI_RES, REL_HWHEEL_HI_RES}) {
+		if (ioctl(fd, UI_SET_RELBIT, rel)) {
+			perror("ioctl set_relbit");
+			exit(-1);
+		}
+	}
+
+	// uinput has no bulk variant, so KEY_RESERVED is the only code skipped
+	for (code = 1; code < KEY_CNT; code++) {
+		if (ioctl(fd, UI_SET_KEYBIT, code)) {
+			perror("ioctl set_keybit");
+			exit(-1);
 		}
 	}
 
@@ -107,29 +281,7 @@ static int create_virtual_keyboard(const char *name)
 			exit(-1);
 		}
 
-	if (ioctl(fd, UI_SET_KEYBIT, KEY_ZOOM)) {
-		perror("ioctl set_keybit");
-		exit(-1);
-	}
-
-	udev.id.bustype = BUS_USB;
-	udev.id.vendor = 0x0FAC;
-	udev.id.product = 0x0ADE;
-
-	snprintf(udev.name, sizeof(udev.name), "%skeyboard", name);
-
-	/*
-	 * We use this in favour of the newer UINPUT_DEV_SETUP
-	 * ioctl in order to support older kernels.
-	 *
-	 * See: https://github.com/torvalds/linux/commit/052876f8e5aec887d22c4d06e54aa5531ffcec75
-	 */
-	ret = write(fd, &udev, sizeof udev);
-
-	if (ret < 0) {
-		fprintf(stderr, "failed to create uinput device\n");
-		exit(-1);
-	}
+	setup_device(fd, name, "keyboard", 0x0ADE, 0);
 
 	if (ioctl(fd, UI_DEV_CREATE)) {
 		perror("ioctl dev_create");
@@ -142,7 +294,6 @@ static int create_virtual_keyboard(const char *name)
 static int create_virtual_pointer(const char *name)
 {
 	uint16_t code;
-	struct uinput_user_dev udev = {};
 
 	int fd = open("/dev/uinput", O_WRONLY | O_NONBLOCK | O_CLOEXEC);
 	if (fd < 0) {
@@ -160,71 +311,176 @@ static int create_virtual_pointer(const char *name)
 	ioctl(fd, UI_SET_RELBIT, REL_X);
 	ioctl(fd, UI_SET_RELBIT, REL_WHEEL);
 	ioctl(fd, UI_SET_RELBIT, REL_HWHEEL);
+	ioctl(fd, UI_SET_RELBIT, REL_WHEEL_HI_RES);
+	ioctl(fd, UI_SET_RELBIT, REL_HWHEEL_HI_RES);
 	ioctl(fd, UI_SET_RELBIT, REL_Y);
 	ioctl(fd, UI_SET_RELBIT, REL_Z);
 
 	for (code = BTN_LEFT; code <= BTN_TASK; code++)
 		ioctl(fd, UI_SET_KEYBIT, code);
 
-	udev.id.bustype = BUS_USB;
-	udev.id.vendor = 0x0FAC;
-	udev.id.product = 0x1ADE;
+	setup_device(fd, name, "pointer", 0x1ADE, 1024);
 
-	udev.absmax[ABS_X] = 1024;
-	udev.absmax[ABS_Y] = 1024;
+	ioctl(fd, UI_DEV_CREATE);
 
-	snprintf(udev.name, sizeof(udev.name), "%spointer", name);
+	return fd;
+}
 
-	if (write(fd, &udev, sizeof udev) < 0) {
-		fprintf(stderr, "failed to create uinput device\n");
+/*
+ * Create a device with the pointer capabilities, axis ranges and properties
+ * of src_fd. Keyboard keys of the source stay on the keyboard device.
+ */
+static int create_clone(const char *name, int src_fd)
+{
+	uint8_t bits[KEY_CNT / 8 + 1];
+	struct input_absinfo absinfo[ABS_CNT] = {};
+	bool has_abs[ABS_CNT] = {};
+	char src_name[UINPUT_MAX_NAME_SIZE] = "";
+	struct input_id id = {};
+
+	auto test_bit = [&](int bit) { return bits[bit / 8] & (1 << (bit % 8)); };
+	auto get_bits = [&](unsigned long req) {
+		memset(bits, 0, sizeof bits);
+		return ioctl(src_fd, req, bits) >= 0;
+	};
+
+	int fd = open("/dev/uinput", O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+	if (fd < 0) {
+		perror("open uinput");
 		exit(-1);
 	}
 
-	ioctl(fd, UI_DEV_CREATE);
+	ioctl(src_fd, EVIOCGNAME(sizeof src_name - 1), src_name);
+	ioctl(src_fd, EVIOCGID, &id);
+
+	ioctl(fd, UI_SET_EVBIT, EV_SYN);
+
+	if (get_bits(EVIOCGBIT(EV_KEY, sizeof bits))) {
+		ioctl(fd, UI_SET_EVBIT, EV_KEY);
+		for (int code = BTN_MISC; code < KEY_OK; code++)
+			if (test_bit(code))
+				ioctl(fd, UI_SET_KEYBIT, code);
+	}
+
+	if (get_bits(EVIOCGBIT(EV_REL, sizeof bits))) {
+		ioctl(fd, UI_SET_EVBIT, EV_REL);
+		for (int code = 0; code < REL_CNT; code++)
+			if (test_bit(code))
+				ioctl(fd, UI_SET_RELBIT, code);
+	}
+
+	if (get_bits(EVIOCGBIT(EV_ABS, sizeof bits))) {
+		ioctl(fd, UI_SET_EVBIT, EV_ABS);
+		for (int code = 0; code < ABS_CNT; code++) {
+			if (test_bit(code) && ioctl(src_fd, EVIOCGABS(code), &absinfo[code]) >= 0) {
+				ioctl(fd, UI_SET_ABSBIT, code);
+				has_abs[code] = true;
+			}
+		}
+	}
+
+	if (get_bits(EVIOCGBIT(EV_MSC, sizeof bits)) && test_bit(MSC_TIMESTAMP)) {
+		ioctl(fd, UI_SET_EVBIT, EV_MSC);
+		ioctl(fd, UI_SET_MSCBIT, MSC_TIMESTAMP);
+	}
+
+	if (get_bits(EVIOCGPROP(sizeof bits))) {
+		for (int prop = 0; prop < INPUT_PROP_CNT; prop++)
+			if (test_bit(prop))
+				ioctl(fd, UI_SET_PROPBIT, prop);
+	}
+
+#ifdef UI_DEV_SETUP
+	struct uinput_setup setup = {};
+	setup.id = id;
+	snprintf(setup.name, sizeof(setup.name), "%s%s", name, src_name);
+
+	if (!ioctl(fd, UI_DEV_SETUP, &setup)) {
+		for (int code = 0; code < ABS_CNT; code++) {
+			if (!has_abs[code])
+				continue;
+
+			struct uinput_abs_setup abs = {};
+			abs.code = code;
+			abs.absinfo = absinfo[code];
+			if (ioctl(fd, UI_ABS_SETUP, &abs))
+				perror("ioctl abs_setup");
+		}
+	} else
+#endif
+	{
+		struct uinput_user_dev udev = {};
+		udev.id = id;
+		snprintf(udev.name, sizeof(udev.name), "%s%s", name, src_name);
+		for (int code = 0; code < ABS_CNT; code++) {
+			udev.absmin[code] = absinfo[code].minimum;
+			udev.absmax[code] = absinfo[code].maximum;
+			udev.absfuzz[code] = absinfo[code].fuzz;
+			udev.absflat[code] = absinfo[code].flat;
+		}
+
+		if (write(fd, &udev, sizeof udev) < 0) {
+			fprintf(stderr, "failed to create uinput device\n");
+			exit(-1);
+		}
+	}
+
+	if (ioctl(fd, UI_DEV_CREATE)) {
+		perror("ioctl dev_create");
+		exit(-1);
+	}
 
 	return fd;
 }
 
+out_queue& vkbd::queue(bool is_ptr)
+{
+	// The pointer device is only created once absolute motion is sent
+	if (is_ptr && ptr.fd == -1)
+		ptr.fd = create_virtual_pointer(name_base.c_str());
+
+	return use(is_ptr ? ptr : kbd);
+}
+
 static void write_key_event(struct vkbd *vkbd, uint16_t code, int state)
 {
-	int is_btn = 0;
-	if (code >= BTN_MOUSE && code < std::min(BTN_JOYSTICK, BTN_MOUSE + 16))
-		is_btn = 1;
-
-	if (is_btn) {
-		/*
-		 * Give key events preceding a mouse click
-		 * a chance to propagate to avoid event
-		 * order transposition. A bit kludegy,
-		 * but better than waiting for all events
-		 * to propagate and then checking them
-		 * on re-entry.
-		 *
-		 * TODO: fixme (maybe)
-		 */
-		usleep(1000);
-	}
-
-	vkbd->send_kbd_event(is_btn, EV_KEY, code, state);
+	if (code < BTN_MOUSE || code >= std::min(BTN_JOYSTICK, BTN_MOUSE + 16)) {
+		vkbd->queue(false).push(EV_KEY, code, state);
+		return;
+	}
+
+	// Presses follow absolute motion to the pointer device, releases the press
+	const uint16_t bit = 1 << (code - BTN_MOUSE);
+	bool is_ptr = vkbd->ptr_buttons & bit;
+
+	if (state == 1) {
+		is_ptr = vkbd->abs_active;
+		vkbd->ptr_buttons = is_ptr ? vkbd->ptr_buttons | bit : vkbd->ptr_buttons & ~bit;
+	} else if (state == 0) {
+		vkbd->ptr_buttons &= ~bit;
+	}
+
+	vkbd->queue(is_ptr).push(EV_KEY, code, state);
 }
 
+// Every call creates a new device, owned by the caller until vkbd_free()
 struct vkbd* vkbd_init(const char* base_name)
 {
-	static struct vkbd vkbd(base_name);
-	if (vkbd.fd == -1)
-		vkbd.fd = create_virtual_keyboard(vkbd.name_base);
-	if (vkbd.pfd == -1)
-		vkbd.pfd = create_virtual_pointer(vkbd.name_base);
+	struct vkbd *vkbd = new struct vkbd(base_name);
+	vkbd->kbd.fd = create_virtual_keyboard(base_name);
+
+	return vkbd;
+}
 
-	return &vkbd;
+// Closing the fds destroys the devices, clones included
+void vkbd_free(struct vkbd *vkbd)
+{
+	delete vkbd;
 }
 
 void vkbd_mouse_move(struct vkbd *vkbd, int x, int y)
 {
-	if (x)
-		vkbd->send_kbd_event(1, EV_REL, REL_X, x);
-	if (y)
-		vkbd->send_kbd_event(1, EV_REL, REL_Y, y);
+	vkbd->send_ptr_frame(EV_REL, REL_X, x, REL_Y, y);
 }
 
 void vkbd_mouse_scroll(struct vkbd* vkbd, int x, int y)
@@ -235,10 +491,7 @@ void vkbd_mouse_scroll(struct vkbd* vkbd, int x, int y)
 
 void vkbd_mouse_move_abs(struct vkbd* vkbd, int x, int y)
 {
-	if (x)
-		vkbd->send_kbd_event(1, EV_ABS, ABS_X, x);
-	if (y)
-		vkbd->send_kbd_event(1, EV_ABS, ABS_Y, y);
+	vkbd->send_ptr_frame(EV_ABS, ABS_X, x, ABS_Y, y);
 }
 
 void vkbd_send_key(struct vkbd* vkbd, uint16_t code, int state)
@@ -247,7 +500,7 @@ void vkbd_send_key(struct vkbd* vkbd, uint16_t code, int state)
 
 	if (KEYD_WHEELEVENT(code) && state) {
 		// Buffer scroll events, a bit ugly but I hate to repeat constants
-		(code & 2 ? vkbd->hwheel_buf : vkbd->vwheel_buf) += (code & 1 ? -1 : 1);
+		(code & 2 ? vkbd->hwheel_buf : vkbd->vwheel_buf) += (code & 1 ? -WHEEL_DETENT : WHEEL_DETENT);
 		return;
 	}
 
@@ -256,11 +509,128 @@ void vkbd_send_key(struct vkbd* vkbd, uint16_t code, int state)
 	write_key_event(vkbd, code, state);
 }
 
+/*
+ * Emit buffered high resolution scrolling, followed by the legacy event once
+ * a whole detent has accumulated (like hardware with hi-res wheels does).
+ * A change of direction starts over from zero.
+ */
+static void push_wheel(out_queue& q, uint16_t code, uint16_t hires_code, int& buf, int& part)
+{
+	if (!buf)
+		return;
+
+	q.push(EV_REL, hires_code, buf);
+
+	if ((part ^ buf) < 0)
+		part = 0;
+	part += std::exchange(buf, 0);
+	if (int detents = part / WHEEL_DETENT) {
+		q.push(EV_REL, code, detents);
+		part -= detents * WHEEL_DETENT;
+	}
+}
+
 void vkbd_flush(struct vkbd* vkbd)
 {
-	// TODO: implement key buffering as well
-	if (int y = std::exchange(vkbd->vwheel_buf, 0))
-		vkbd->send_kbd_event(1, EV_REL, REL_WHEEL, y);
-	if (int x = std::exchange(vkbd->hwheel_buf, 0))
-		vkbd->send_kbd_event(1, EV_REL, REL_HWHEEL, x);
+	if (vkbd->vwheel_buf || vkbd->hwheel_buf) {
+		out_queue& q = vkbd->queue(false);
+		push_wheel(q, REL_HWHEEL, REL_HWHEEL_HI_RES, vkbd->hwheel_buf, vkbd->hwheel_part);
+		push_wheel(q, REL_WHEEL, REL_WHEEL_HI_RES, vkbd->vwheel_buf, vkbd->vwheel_part);
+		q.sync();
+	}
+
+	if (!vkbd->kbd.evs.empty())
+		vkbd->kbd.write();
+	if (!vkbd->ptr.evs.empty())
+		vkbd->ptr.write();
+	for (auto& c : vkbd->clones) {
+		if (!c->q.evs.empty())
+			c->q.write();
+	}
 }
+
+/* Return true if the keyboard device has every capability of src_fd but keys. */
+static bool can_merge(int src_fd)
+{
+	uint8_t bits[REL_CNT / 8 + 1] = {};
+	unsigned long abs = 0;
+
+	if (ioctl(src_fd, EVIOCGBIT(EV_ABS, sizeof abs), &abs) >= 0 && abs)
+		return false;
+	if (ioctl(src_fd, EVIOCGBIT(EV_REL, sizeof bits), bits) < 0)
+		return false;
+
+	for (int code = 0; code < REL_CNT; code++) {
+		if (!(bits[code / 8] & (1 << (code % 8))))
+			continue;
+		switch (code) {
+		case REL_X:
+		case REL_Y:
+		case REL_WHEEL:
+		case REL_HWHEEL:
+		case REL_WHEEL_HI_RES:
+		case REL_HWHEEL_HI_RES:
+			break;
+		default:
+			return false;
+		}
+	}
+
+	return true;
+}
+
+void vkbd_send_frame(struct vkbd* vkbd, int src_fd, const struct input_event *evs, size_t n)
+{
+	auto it = std::find_if(vkbd->clones.begin(), vkbd->clones.end(), [&](auto& c) {
+		return c->src_fd == src_fd;
+	});
+
+	if (it == vkbd->clones.end()) {
+		auto& c = vkbd->clones.emplace_back(std::make_unique<clone>());
+		c->src_fd = src_fd;
+		c->merged = can_merge(src_fd);
+		if (!c->merged)
+			c->q.fd = create_clone(vkbd->name_base.c_str(), src_fd);
+		it = vkbd->clones.end() - 1;
+	}
+
+	clone& c = **it;
+	if (c.merged) {
+		// Timestamps and the like are dropped
+		for (size_t i = 0; i < n; i++) {
+			if (evs[i].type == EV_KEY && evs[i].code < KEY_CNT) {
+				c.held[evs[i].code] = evs[i].value != 0;
+				write_key_event(vkbd, evs[i].code, evs[i].value);
+			} else if (evs[i].type == EV_REL) {
+				if (evs[i].code == REL_X || evs[i].code == REL_Y)
+					vkbd->abs_active = false;
+				vkbd->queue(false).push(EV_REL, evs[i].code, evs[i].value);
+			}
+		}
+		vkbd->queue(false).sync();
+		return;
+	}
+
+	// Frames are complete, so multitouch slots may repeat codes
+	out_queue& q = vkbd->use(c.q);
+	q.evs.insert(q.evs.end(), evs, evs + n);
+	q.sync();
+}
+
+void vkbd_remove_source(struct vkbd* vkbd, int src_fd)
+{
+	std::erase_if(vkbd->clones, [&](auto& c) {
+		if (c->src_fd != src_fd)
+			return false;
+		if (vkbd->cur == &c->q)
+			vkbd->cur = nullptr;
+		for (size_t code = 0; code < c->held.size(); code++)
+			if (c->held[code])
+				write_key_event(vkbd, code, 0);
+		return true;
+	});
+}
+
+}
+
+const struct vkbd_backend uinput_backend = VKBD_BACKEND("uinput", uinput_out);
@@ -10,6 +10,11 @@
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <stddef.h>
+#include <algorithm>
+#include <bitset>
+#include <limits>
 #include "../keyd.h"
 #include "../keys.h"
 #include "usb-gadget.h"
@@ -22,6 +27,8 @@
 	#include <linux/input-event-codes.h>
 #endif
 
+namespace usb_gadget_out {
+
 constexpr std::array<uint8_t, KEYD_ENTRY_COUNT> hid_table = []() {
 	std::array<uint8_t, KEYD_ENTRY_COUNT> r{};
 	r[KEY_ESC] = 0x29,
@@ -173,12 +180,59 @@ constexpr std::array<uint8_t, KEYD_ENTRY_COUNT> hid_table = []() {
 	return r;
 }();
 
-static uint8_t mods = 0;
+/* Usages below this are reported in the NKRO bitmap (modifiers are separate). */
+#define NKRO_USAGES	0xe0
+
+/*
+ * Boot protocol reports carry up to 6 keys, NKRO reports (KEYD_USB_NKRO) a
+ * bitmap of all usages. Reports are built in place and written on
+ * vkbd_flush() if they differ from the last one sent. A usage changing twice
+ * before that writes the intermediate report, so taps are not lost.
+ */
+struct hid_report {
+	uint8_t hid_mods;
+	uint8_t reserved;
+	union {
+		uint8_t hid_code[6];
+		uint8_t bitmap[NKRO_USAGES / 8];
+	};
+};
 
-static uint8_t keys[6] = {0};
+/*
+ * Mouse reports (/dev/hidg1) carry 16 bit relative motion and 8 bit wheels.
+ * Motion and scrolling accumulate between flushes (split over several
+ * reports if out of range), buttons follow the same rules as keys.
+ */
+struct mouse_report {
+	uint8_t buttons;
+	int16_t x;
+	int16_t y;
+	int8_t wheel;
+	int8_t hwheel;
+} __attribute__((packed));
 
 struct vkbd {
 	int fd = -1;
+	bool nkro = false;
+
+	struct hid_report report = {};
+	struct hid_report sent = {};
+
+	// Usages changed since the last report was written
+	std::bitset<256> changed;
+
+	// Opened on first use, -2 if unavailable
+	int mouse_fd = -1;
+	uint8_t buttons = 0;
+	uint8_t buttons_sent = 0;
+	uint8_t buttons_changed = 0;
+	int x_buf = 0;
+	int y_buf = 0;
+	int vwheel_buf = 0;
+	int hwheel_buf = 0;
+	// Partial detents of high resolution scrolling
+	int vwheel_part = 0;
+	int hwheel_part = 0;
 
 	vkbd() = default;
 	vkbd(const vkbd&) = delete;
@@ -186,18 +240,26 @@ struct vkbd {
 	~vkbd()
 	{
 		close(fd);
+		if (mouse_fd >= 0)
+			close(mouse_fd);
 	}
-};
 
-struct hid_report {
-	uint8_t hid_mods;
-	uint8_t reserved;
-	uint8_t hid_code[6];
+	size_t report_size() const
+	{
+		return nkro ? sizeof(report) : offsetof(hid_report, hid_code) + sizeof(report.hid_code);
+	}
 };
 
+// The device nodes may be overridden for testing
+static const char *hidg_path(const char *var, const char *def)
+{
+	const char *path = getenv(var);
+	return path && *path ? path : def;
+}
+
 static int create_virtual_keyboard()
 {
-	int fd = open("/dev/hidg0", O_WRONLY | O_NONBLOCK);
+	int fd = open(hidg_path("KEYD_USB_HIDG0", "/dev/hidg0"), O_WRONLY | O_NONBLOCK);
 	if (fd < 0) {
 		perror("open");
 		exit(-1);
@@ -206,16 +268,85 @@ static int create_virtual_keyboard()
 	return fd;
 }
 
-static void send_hid_report(const struct vkbd *vkbd)
+static void send_hid_report(struct vkbd *vkbd)
+{
+	vkbd->changed.reset();
+
+	if (!memcmp(&vkbd->report, &vkbd->sent, vkbd->report_size()))
+		return;
+
+	if (write(vkbd->fd, &vkbd->report, vkbd->report_size()) < 0) {
+		// The host is not polling, the next report carries the full state
+		if (errno != EAGAIN)
+			perror("write hidg0");
+		return;
+	}
+
+	vkbd->sent = vkbd->report;
+}
+
+static bool open_mouse(struct vkbd *vkbd)
+{
+	if (vkbd->mouse_fd == -1) {
+		vkbd->mouse_fd = open(hidg_path("KEYD_USB_HIDG1", "/dev/hidg1"), O_WRONLY | O_NONBLOCK);
+		if (vkbd->mouse_fd < 0) {
+			perror("usb-gadget: open /dev/hidg1 (mouse support disabled)");
+			vkbd->mouse_fd = -2;
+		}
+	}
+
+	return vkbd->mouse_fd >= 0;
+}
+
+/* Take as much of buf as fits into T (the descriptor excludes T's minimum). */
+template <typename T>
+static T take(int& buf)
+{
+	constexpr int max = std::numeric_limits<T>::max();
+	int v = std::clamp<int>(buf, -max, max);
+	buf -= v;
+	return v;
+}
+
+static void send_mouse_report(struct vkbd *vkbd)
 {
-	struct hid_report report;
+	vkbd->buttons_changed = 0;
 
-	for (int i = 0; i < 6; i++)
-		report.hid_code[i] = keys[i];
+	while (vkbd->buttons != vkbd->buttons_sent ||
+	       vkbd->x_buf || vkbd->y_buf || vkbd->vwheel_buf || vkbd->hwheel_buf) {
+		struct mouse_report mr;
+		mr.buttons = vkbd->buttons;
+		mr.x = take<int16_t>(vkbd->x_buf);
+		mr.y = take<int16_t>(vkbd->y_buf);
+		mr.wheel = take<int8_t>(vkbd->vwheel_buf);
+		mr.hwheel = take<int8_t>(vkbd->hwheel_buf);
 
-	report.hid_mods = mods;
+		if (write(vkbd->mouse_fd, &mr, sizeof mr) < 0) {
+			// Motion is relative, so dropping it beats stalling
+			if (errno != EAGAIN)
+				perror("write hidg1");
+			return;
+		}
 
-	xwrite(vkbd->fd, &report, sizeof(report));
+		vkbd->buttons_sent = mr.buttons;
+	}
+}
+
+static void send_button(struct vkbd *vkbd, uint16_t code, int state)
+{
+	uint8_t bit = 1 << (code - BTN_LEFT);
+
+	if (!open_mouse(vkbd))
+		return;
+
+	if (vkbd->buttons_changed & bit)
+		send_mouse_report(vkbd);
+	vkbd->buttons_changed |= bit;
+
+	if (state)
+		vkbd->buttons |= bit;
+	else
+		vkbd->buttons &= ~bit;
 }
 
 static uint8_t get_modifier(int code)
@@ -251,29 +382,36 @@ static uint8_t get_modifier(int code)
 	}
 }
 
-static int update_modifier_state(int code, int state)
+static int update_modifier_state(struct vkbd *vkbd, int code, int state)
 {
 	uint16_t mod = get_modifier(code);
 
 	if (mod) {
 		if (state)
-			mods |= mod;
+			vkbd->report.hid_mods |= mod;
 		else
-			mods &= ~mod;
+			vkbd->report.hid_mods &= ~mod;
 		return 0;
 	}
 
 	return -1;
 }
 
-static void update_key_state(uint16_t code, int state)
+static void update_key_state(struct vkbd *vkbd, uint8_t hid_code, int state)
 {
-	if (code > KEY_MAX)
-		return;
-
 	int i;
 	int set = 0;
-	uint8_t hid_code = hid_table[code];
+	uint8_t *keys = vkbd->report.hid_code;
+
+	if (vkbd->nkro) {
+		if (hid_code >= NKRO_USAGES)
+			return;
+		if (state)
+			vkbd->report.bitmap[hid_code / 8] |= 1 << (hid_code % 8);
+		else
+			vkbd->report.bitmap[hid_code / 8] &= ~(1 << (hid_code % 8));
+		return;
+	}
 
 	for (i = 0; i < 6; i++) {
 		if (keys[i] == hid_code) {
@@ -295,35 +433,116 @@ static void update_key_state(uint16_t code, int state)
 struct vkbd* vkbd_init(const char *)
 {
 	static struct vkbd vkbd;
-	if (vkbd.fd == -1)
+	if (vkbd.fd == -1) {
 		vkbd.fd = create_virtual_keyboard();
+		vkbd.nkro = getenv("KEYD_USB_NKRO");
+	}
 
 	return &vkbd;
 }
 
+// The gadget is shared by every vkbd_init()
+void vkbd_free(struct vkbd*)
+{
+}
+
 void vkbd_mouse_move(struct vkbd* vkbd, int x, int y)
 {
-	fprintf(stderr, "usb-gadget: mouse support is not implemented\n");
+	if (!open_mouse(vkbd))
+		return;
+
+	vkbd->x_buf += x;
+	vkbd->y_buf += y;
 }
 
-void vkbd_mouse_move_abs(struct vkbd* vkbd, int x, int y)
+void vkbd_mouse_move_abs(struct vkbd*, int, int)
 {
-	fprintf(stderr, "usb-gadget: mouse support is not implemented\n");
+	fprintf(stderr, "usb-gadget: absolute mouse movement is not supported\n");
 }
 
 void vkbd_mouse_scroll(struct vkbd* vkbd, int x, int y)
 {
-	fprintf(stderr, "usb-gadget: mouse support is not implemented\n");
+	if (!open_mouse(vkbd))
+		return;
+
+	// A change of direction drops the partial detent
+	if ((vkbd->hwheel_part ^ x) < 0)
+		vkbd->hwheel_part = 0;
+	if ((vkbd->vwheel_part ^ y) < 0)
+		vkbd->vwheel_part = 0;
+
+	vkbd->hwheel_part += x;
+	vkbd->hwheel_buf += vkbd->hwheel_part / WHEEL_DETENT;
+	vkbd->hwheel_part %= WHEEL_DETENT;
+
+	vkbd->vwheel_part += y;
+	vkbd->vwheel_buf += vkbd->vwheel_part / WHEEL_DETENT;
+	vkbd->vwheel_part %= WHEEL_DETENT;
 }
 
 void vkbd_send_key(struct vkbd* vkbd, uint16_t code, int state)
 {
-	if (update_modifier_state(code, state) < 0)
-		update_key_state(code, state);
+	if (KEYD_WHEELEVENT(code)) {
+		if (state && open_mouse(vkbd))
+			(code & 2 ? vkbd->hwheel_buf : vkbd->vwheel_buf) += (code & 1 ? -1 : 1);
+		return;
+	}
 
-	send_hid_report(vkbd);
+	if (code >= BTN_LEFT && code <= BTN_EXTRA) {
+		send_button(vkbd, code, state);
+		return;
+	}
+
+	if (code > KEY_MAX || !hid_table[code])
+		return;
+
+	uint8_t hid_code = hid_table[code];
+	if (vkbd->changed[hid_code])
+		send_hid_report(vkbd);
+	vkbd->changed[hid_code] = true;
+
+	if (update_modifier_state(vkbd, code, state) < 0)
+		update_key_state(vkbd, hid_code, state);
 }
 
-void vkbd_flush(struct vkbd*)
+// The relative parts of the frame are translated, absolute axes are dropped
+void vkbd_send_frame(struct vkbd* vkbd, int, const struct input_event *evs, size_t n)
+{
+	for (size_t i = 0; i < n; i++) {
+		const struct input_event& ev = evs[i];
+
+		if (ev.type == EV_KEY && ev.code >= BTN_LEFT && ev.code <= BTN_EXTRA) {
+			send_button(vkbd, ev.code, ev.value);
+		} else if (ev.type == EV_REL && open_mouse(vkbd)) {
+			switch (ev.code) {
+			case REL_X:
+				vkbd->x_buf += ev.value;
+				break;
+			case REL_Y:
+				vkbd->y_buf += ev.value;
+				break;
+			case REL_WHEEL:
+				vkbd->vwheel_buf += ev.value;
+				break;
+			case REL_HWHEEL:
+				vkbd->hwheel_buf += ev.value;
+				break;
+			}
+		}
+	}
+}
+
+void vkbd_remove_source(struct vkbd*, int)
 {
 }
+
+void vkbd_flush(struct vkbd* vkbd)
+{
+	send_hid_report(vkbd);
+	if (vkbd->mouse_fd >= 0)
+		send_mouse_report(vkbd);
+}
+
+}
+
+const struct vkbd_backend usb_gadget_backend = VKBD_BACKEND("usb-gadget", usb_gadget_out);
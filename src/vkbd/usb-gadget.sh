@@ -5,10 +5,24 @@ mkdir g1
 cd g1
 mkdir configs/c.1
 mkdir functions/hid.usb0
-echo 1 > functions/hid.usb0/protocol
-echo 1 > functions/hid.usb0/subclass
-echo 8 > functions/hid.usb0/report_length
-echo -ne \\x05\\x01\\x09\\x06\\xa1\\x01\\x05\\x07\\x19\\xe0\\x29\\xe7\\x15\\x00\\x25\\x01\\x75\\x01\\x95\\x08\\x81\\x02\\x95\\x01\\x75\\x08\\x81\\x03\\x95\\x05\\x75\\x01\\x05\\x08\\x19\\x01\\x29\\x05\\x91\\x02\\x95\\x01\\x75\\x03\\x91\\x03\\x95\\x06\\x75\\x08\\x15\\x00\\x25\\x65\\x05\\x07\\x19\\x00\\x29\\x65\\x81\\x00\\xc0 > functions/hid.usb0/report_desc
+if [ "$1" = nkro ]; then
+	# Bitmap of usages 0x00-0xdf, requires KEYD_USB_NKRO=1 in keyd's environment
+	echo 0 > functions/hid.usb0/protocol
+	echo 0 > functions/hid.usb0/subclass
+	echo 30 > functions/hid.usb0/report_length
+	echo -ne \\x05\\x01\\x09\\x06\\xa1\\x01\\x05\\x07\\x19\\xe0\\x29\\xe7\\x15\\x00\\x25\\x01\\x75\\x01\\x95\\x08\\x81\\x02\\x95\\x01\\x75\\x08\\x81\\x03\\x95\\x05\\x75\\x01\\x05\\x08\\x19\\x01\\x29\\x05\\x91\\x02\\x95\\x01\\x75\\x03\\x91\\x03\\x05\\x07\\x19\\x00\\x29\\xdf\\x15\\x00\\x25\\x01\\x75\\x01\\x95\\xe0\\x81\\x02\\xc0 > functions/hid.usb0/report_desc
+else
+	echo 1 > functions/hid.usb0/protocol
+	echo 1 > functions/hid.usb0/subclass
+	echo 8 > functions/hid.usb0/report_length
+	echo -ne \\x05\\x01\\x09\\x06\\xa1\\x01\\x05\\x07\\x19\\xe0\\x29\\xe7\\x15\\x00\\x25\\x01\\x75\\x01\\x95\\x08\\x81\\x02\\x95\\x01\\x75\\x08\\x81\\x03\\x95\\x05\\x75\\x01\\x05\\x08\\x19\\x01\\x29\\x05\\x91\\x02\\x95\\x01\\x75\\x03\\x91\\x03\\x95\\x06\\x75\\x08\\x15\\x00\\x25\\x65\\x05\\x07\\x19\\x00\\x29\\x65\\x81\\x00\\xc0 > functions/hid.usb0/report_desc
+fi
+# Relative mouse: 5 buttons, 16 bit x/y, wheel and horizontal wheel
+mkdir functions/hid.usb1
+echo 0 > functions/hid.usb1/protocol
+echo 0 > functions/hid.usb1/subclass
+echo 7 > functions/hid.usb1/report_length
+echo -ne \\x05\\x01\\x09\\x02\\xa1\\x01\\x09\\x01\\xa1\\x00\\x05\\x09\\x19\\x01\\x29\\x05\\x15\\x00\\x25\\x01\\x95\\x05\\x75\\x01\\x81\\x02\\x95\\x01\\x75\\x03\\x81\\x03\\x05\\x01\\x09\\x30\\x09\\x31\\x16\\x01\\x80\\x26\\xff\\x7f\\x75\\x10\\x95\\x02\\x81\\x06\\x09\\x38\\x15\\x81\\x25\\x7f\\x75\\x08\\x95\\x01\\x81\\x06\\x05\\x0c\\x0a\\x38\\x02\\x15\\x81\\x25\\x7f\\x75\\x08\\x95\\x01\\x81\\x06\\xc0\\xc0 > functions/hid.usb1/report_desc
 mkdir strings/0x409
 mkdir configs/c.1/strings/0x409
 echo 0x0100 > bcdDevice
@@ -26,4 +40,5 @@ echo "Conf 1" > configs/c.1/strings/0x409/configuration
 echo 0x80 > configs/c.1/bmAttributes
 echo 500 > configs/c.1/MaxPower
 ln -s functions/hid.usb0 configs/c.1
+ln -s functions/hid.usb1 configs/c.1
 ls /sys/class/udc > UDC
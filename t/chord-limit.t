@@ -0,0 +1,38 @@
+kp1 down
+kp2 down
+200ms
+kp3 down
+kp4 down
+200ms
+kp5 down
+kp6 down
+200ms
+kp7 down
+kp8 down
+200ms
+kp9 down
+kp0 down
+200ms
+kp1 up
+kp2 up
+kp3 up
+kp4 up
+kp5 up
+kp6 up
+kp7 up
+kp8 up
+kp9 up
+kp0 up
+
+f1 down
+f2 down
+f3 down
+f4 down
+kp9 down
+kp0 down
+f1 up
+f2 up
+f3 up
+f4 up
+kp9 up
+kp0 up
@@ -0,0 +1,22 @@
+f21 down
+f13 down
+f17 down
+f14 down
+f20 down
+f15 down
+f19 down
+f16 down
+f18 down
+200ms
+f13 up
+f14 up
+f15 up
+f16 up
+f17 up
+f18 up
+f19 up
+f20 up
+f21 up
+
+x down
+x up
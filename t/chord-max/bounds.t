@@ -0,0 +1,32 @@
+# The upper bound is accepted, 0 is rejected (5 chords held at once)
+a down
+b down
+c down
+d down
+e down
+f down
+g down
+h down
+i down
+j down
+a up
+b up
+c up
+d up
+e up
+f up
+g up
+h up
+i up
+j up
+
+1 down
+2 down
+3 down
+4 down
+5 down
+1 up
+2 up
+3 up
+4 up
+5 up
@@ -0,0 +1,91 @@
+1 down
+5 down
+z down
+q down
+r down
+t down
+u down
+v down
+x down
+y down
+g down
+i down
+n down
+f1 down
+f2 down
+f3 down
+f4 down
+f5 down
+f6 down
+h down
+a down
+a up
+z up
+a down
+a up
+5 up
+a down
+a up
+h up
+f6 up
+q up
+r up
+t up
+u up
+v up
+x up
+y up
+g up
+i up
+n up
+f1 up
+f2 up
+f3 up
+f4 up
+f5 up
+1 up
+
+leftcontrol down
+q down
+r down
+t down
+u down
+v down
+x down
+y down
+g down
+i down
+n down
+f1 down
+f2 down
+f3 down
+f4 down
+f5 down
+f6 down
+h down
+leftcontrol up
+b down
+b up
+leftcontrol down
+leftcontrol up
+[ down
+[ up
+a down
+a up
+h up
+f6 up
+q up
+r up
+t up
+u up
+v up
+x up
+y up
+g up
+i up
+n up
+f1 up
+f2 up
+f3 up
+f4 up
+f5 up
@@ -31,6 +31,11 @@ cp test.conf "$tmpdir"
 pid=$!
 
 sleep .7s
+if [ "$1" = "--bench-click" ]; then
+	./runner.py --bench-click "${2:-1000}"
+	cleanup
+fi
+
 if [ $# -ne 0 ]; then
 	test_files="$(echo "$@"|sed -e 's/ /.t /g').t"
 	./runner.py -v $test_files
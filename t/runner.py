@@ -177,6 +177,9 @@ class KeyStream():
 
                 events.append((key, value))
 
+    def fileno(self):
+        return self.fh.fileno()
+
     # Block until the next event
     def next(self):
         EV_KEY = 0x01
@@ -327,13 +330,56 @@ def run_test(name, input, output, verbose):
     return True
 
 
+# Measure the time from a key mapped to leftmouse (f12) until the click
+# leaves keyd. Buttons are read from the keyboard and, if present, the
+# pointer device, so older builds can be compared.
+def bench_click(n):
+    streams = [stream]
+    try:
+        pointer = KeyStream(name="keyd virtual pointer")
+        pointer.grab()
+        streams.append(pointer)
+    except Exception:
+        pass
+
+    sel = selectors.DefaultSelector()
+    for s in streams:
+        sel.register(s, selectors.EVENT_READ)
+
+    def await_button(state):
+        while True:
+            for key, _ in sel.select():
+                k, v = key.fileobj.next()
+                if k.name == "btn left" and v == state:
+                    return
+
+    samples = []
+    for _ in range(n):
+        for state in (1, 0):
+            start = time.perf_counter()
+            vkbd.write_code(88, state)  # KEY_F12
+            await_button(state)
+            samples.append((time.perf_counter() - start) * 1E6)
+
+    samples.sort()
+    print('click latency (%d samples): avg %d us, median %d us, max %d us' %
+          (len(samples), sum(samples) / len(samples), samples[len(samples) // 2], samples[-1]))
+
+
 import argparse
 parser = argparse.ArgumentParser()
 parser.add_argument('-v', '--verbose', default=False, action='store_true')
 parser.add_argument('-e', '--exit-on-fail', default=False, action='store_true')
+parser.add_argument('-b', '--bench-click', default=0, type=int, metavar='N',
+                    help='measure the latency of N clicks instead of running tests')
 parser.add_argument('files', nargs=argparse.REMAINDER)
 args = parser.parse_args()
 
+if args.bench_click:
+    signal.alarm(0)
+    bench_click(args.bench_click)
+    exit(0)
+
 
 # Prevent gc from interfering with
 # timeout precision.
@@ -133,7 +133,7 @@ static int parse_events(char *s, struct key_event in[MAX_EVENTS], size_t *nin,
 			struct key_event out[MAX_EVENTS], size_t *nout)
 {
 	int ret;
-	int time = 0;
+	int64_t time = 0;
 	int ln = 0;
 	int n = 0;
 	struct key_event *events = in;
@@ -174,7 +174,7 @@ static int parse_events(char *s, struct key_event in[MAX_EVENTS], size_t *nin,
 		}
 
 		if (len >= 2 && line[len - 1] == 's' && line[len - 2] == 'm') {
-			time += atoi(line);
+			time += atoi(line) * 1000;
 		} else {
 			uint16_t code;
 			char *k = strtok(line, " ");
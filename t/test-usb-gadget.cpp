@@ -0,0 +1,93 @@
+/*
+ * Drive the usb-gadget backend with regular files standing in for the hidg
+ * devices and check the mouse reports written to them.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <vector>
+#include "../src/keyd.h"
+
+struct mouse_report {
+	uint8_t buttons;
+	int16_t x;
+	int16_t y;
+	int8_t wheel;
+	int8_t hwheel;
+} __attribute__((packed));
+
+static char kbd_path[] = "/tmp/keyd-hidg0-XXXXXX";
+static char mouse_path[] = "/tmp/keyd-hidg1-XXXXXX";
+static const struct vkbd_backend& be = usb_gadget_backend;
+static void *vkbd;
+static int failed = 0;
+
+/* Reports written since the last call. */
+static std::vector<mouse_report> read_reports()
+{
+	static off_t off = 0;
+	std::vector<mouse_report> r;
+	mouse_report mr;
+
+	int fd = open(mouse_path, O_RDONLY);
+	lseek(fd, off, SEEK_SET);
+	while (read(fd, &mr, sizeof mr) == sizeof mr)
+		r.push_back(mr);
+	off = lseek(fd, 0, SEEK_CUR);
+	close(fd);
+
+	return r;
+}
+
+static void check(const char *name, bool ok)
+{
+	printf("%s %s\n", name, ok ? "\033[32;1mPASSED\033[0m" : "\033[31;1mFAILED\033[0m");
+	failed |= !ok;
+}
+
+/* Reports must stay within the logical range of the descriptor and add up. */
+static bool check_motion(int x, int y, int wheel, int hwheel)
+{
+	for (auto& mr : read_reports()) {
+		if (mr.x < -32767 || mr.y < -32767 || mr.wheel < -127 || mr.hwheel < -127)
+			return false;
+		x -= mr.x;
+		y -= mr.y;
+		wheel -= mr.wheel;
+		hwheel -= mr.hwheel;
+	}
+
+	return !x && !y && !wheel && !hwheel;
+}
+
+int main()
+{
+	close(mkstemp(kbd_path));
+	close(mkstemp(mouse_path));
+	setenv("KEYD_USB_HIDG0", kbd_path, 1);
+	setenv("KEYD_USB_HIDG1", mouse_path, 1);
+
+	vkbd = be.init("test");
+
+	be.mouse_move(vkbd, -100000, 70000);
+	be.flush(vkbd);
+	check("motion-range", check_motion(-100000, 70000, 0, 0));
+
+	for (int i = 0; i < 300; i++)
+		be.send_key(vkbd, KEYD_WHEELDOWN, 1);
+	be.send_key(vkbd, KEYD_WHEELLEFT, 1);
+	be.flush(vkbd);
+	check("wheel-range", check_motion(0, 0, -300, 1));
+
+	// Half a detent up, then a whole one down
+	be.mouse_scroll(vkbd, 0, WHEEL_DETENT / 2);
+	be.mouse_scroll(vkbd, 0, -WHEEL_DETENT);
+	be.flush(vkbd);
+	check("wheel-reverse", check_motion(0, 0, -1, 0));
+
+	unlink(kbd_path);
+	unlink(mouse_path);
+	return failed;
+}